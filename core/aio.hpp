@@ -0,0 +1,143 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+#include <vector>
+
+// raw syscalls, so that no libaio is needed at link time
+inline int sys_io_setup(unsigned nr_events, aio_context_t * ctx) {
+	return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+inline int sys_io_destroy(aio_context_t ctx) {
+	return syscall(__NR_io_destroy, ctx);
+}
+
+inline int sys_io_submit(aio_context_t ctx, long nr, struct iocb ** iocbpp) {
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+inline int sys_io_getevents(aio_context_t ctx, long min_nr, long max_nr, struct io_event * events, struct timespec * timeout) {
+	return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+// pread until length bytes are read or EOF is hit
+inline long pread_full(int fd, char * buffer, long length, long offset) {
+	long done = 0;
+	while (done < length) {
+		long bytes = pread(fd, buffer + done, length - done, offset + done);
+		if (bytes==-1) {
+			if (errno==EINTR) continue;
+			fprintf(stderr, "pread failed: %s\n", strerror(errno));
+			exit(-1);
+		}
+		if (bytes==0) break;
+		done += bytes;
+	}
+	return done;
+}
+
+/**
+ * @brief 基于Linux native AIO的异步读取器，最多同时有depth个读请求在飞。配合O_DIRECT才是真正异步的。
+ */
+class AsyncReader {
+	aio_context_t ctx;
+	int depth;
+	int inflight;
+	std::vector<struct iocb> cbs;
+	std::vector<int> free_slots;
+	std::vector<struct io_event> events;
+public:
+	AsyncReader(int depth) : depth(depth), inflight(0), cbs(depth), events(depth) {
+		ctx = 0;
+		if (sys_io_setup(depth, &ctx)!=0) {
+			fprintf(stderr, "io_setup failed: %s\n", strerror(errno));
+			exit(-1);
+		}
+		for (int i=depth-1;i>=0;i--) {
+			free_slots.push_back(i);
+		}
+	}
+	~AsyncReader() {
+		assert(inflight==0);
+		sys_io_destroy(ctx);
+	}
+	bool full() {
+		return inflight==depth;
+	}
+	int pending() {
+		return inflight;
+	}
+	void submit(int fd, char * buffer, long length, long offset) {
+		assert(!full());
+		int slot = free_slots.back();
+		free_slots.pop_back();
+		struct iocb & cb = cbs[slot];
+		memset(&cb, 0, sizeof(cb));
+		cb.aio_data = slot;
+		cb.aio_fildes = fd;
+		cb.aio_lio_opcode = IOCB_CMD_PREAD;
+		cb.aio_buf = (unsigned long)buffer;
+		cb.aio_nbytes = length;
+		cb.aio_offset = offset;
+		struct iocb * cbp = &cb;
+		int ret;
+		while ((ret = sys_io_submit(ctx, 1, &cbp))!=1) {
+			if (ret==-1 && (errno==EAGAIN || errno==EINTR)) continue;
+			fprintf(stderr, "io_submit failed: %s\n", strerror(errno));
+			exit(-1);
+		}
+		inflight++;
+	}
+	/**
+	 * @brief 收割至少min_nr个已完成的读请求（min_nr==0时不阻塞），对每个请求调用complete(buffer, offset, length, result)。
+	 */
+	template <typename F>
+	int reap(long min_nr, F complete) {
+		if (inflight==0) return 0;
+		struct timespec zero_timeout = {0, 0};
+		int ret;
+		while ((ret = sys_io_getevents(ctx, min_nr, inflight, events.data(), min_nr==0 ? &zero_timeout : NULL))==-1) {
+			if (errno==EINTR) continue;
+			fprintf(stderr, "io_getevents failed: %s\n", strerror(errno));
+			exit(-1);
+		}
+		for (int i=0;i<ret;i++) {
+			int slot = events[i].data;
+			char * buffer = (char *)cbs[slot].aio_buf;
+			long offset = cbs[slot].aio_offset;
+			long length = cbs[slot].aio_nbytes;
+			inflight--;
+			free_slots.push_back(slot);
+			complete(buffer, offset, length, (long)events[i].res);
+		}
+		return ret;
+	}
+};
+
+#endif
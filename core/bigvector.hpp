@@ -21,12 +21,14 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
-#include <omp.h>
 
+#include <deque>
 #include <thread>
 
+#include "core/buffermanager.hpp"
 #include "core/filesystem.hpp"
 #include "core/partition.hpp"
+#include "core/threadpool.hpp"
 #include "core/util.hpp"
 
 template <typename T>
@@ -34,6 +36,13 @@ template <typename T>
  * @brief 
  * BigVector是一个围绕文件建立的连续缓冲区。文件本身用mmap进行优化，其次会针对文件的某个连续空间做memory缓存。当调用BigVector的save函数后，这部分连续memory会被写入文件，并释放内存。而如果调用load，则重新申请一块内存，把对应区域文件内容存入对应的memory里。
  * 
+ * BufferManager设置了budget（Graph::set_memory_bytes）时，改为按页交给BufferManager管理：访问时按需读入，
+ * pin/unpin固定一段点，load/save变成pin住窗口/写回窗口的脏页再unpin。只读的访问用get()，不会把页弄脏。
+ * 分页时可以先load下一个窗口再save上一个（save的总是最早load的那个），stream_vertices靠这个重叠窗口的I/O和计算。
+ * 两种方式都按DIRTYCHUNKSIZE记录写过的块，save/sync/换出只写（或msync）脏块。
+ *
+ * 整个vector能放进budget时（BufferManager::reserve_in_memory）直接放在匿名内存里，不建文件、不清零文件，
+ * 写也不会弄脏page cache；文件已经存在且大小相符时私有映射它（按需读，写时复制）。只有checkpoint()/sync()才写文件。
  */
 class BigVector {
 	std::string path;
@@ -41,7 +50,42 @@ class BigVector {
 	bool in_memory = false;
 	size_t begin_i = 0, end_i = 0;
 	T * data_in_memory = NULL;
+	int window_backing = PAGES_SMALL;
+	PagedRegion * region = NULL;
+	std::deque<std::pair<size_t, size_t>> windows; // 分页时load了还没save的窗口，按load的顺序
+	DirtyChunks dirty; // 不分页时的脏块，分页时由PagedRegion记录
+	bool anonymous = false; // 整个放在内存里，只在checkpoint时写文件
+	bool file_backed = false; // 匿名模式下文件内容和内存一致（除了脏块）
+	int anonymous_backing = PAGES_SMALL; // -1表示私有映射的文件
+	long anonymous_bytes = 0;
 	static const long PAGESIZE = 4096;
+	static const size_t PAGE_ELEMENTS = VERTEXPAGESIZE / sizeof(T);
+	// [begin_i, end_i)对应的页
+	long first_page(size_t begin_i) {
+		return begin_i / PAGE_ELEMENTS;
+	}
+	long last_page(size_t end_i) {
+		return (end_i + PAGE_ELEMENTS - 1) / PAGE_ELEMENTS;
+	}
+	static long chunk_of(size_t i) {
+		return i * sizeof(T) / DIRTYCHUNKSIZE;
+	}
+	inline void mark_dirty(size_t i) {
+		dirty.mark(chunk_of(i));
+		// 元素跨块时两块都记上
+		if (DIRTYCHUNKSIZE % sizeof(T) != 0) dirty.mark(((i + 1) * sizeof(T) - 1) / DIRTYCHUNKSIZE);
+	}
+	T & at(size_t i) {
+		if (in_memory) {
+			if (!(i >= begin_i && i <= end_i)) {
+				printf("%s %lu %lu %lu\n", path.c_str(), begin_i, i, end_i);
+				exit(-1);
+			}
+			return data_in_memory[i - begin_i];
+		} else {
+			return data[i];
+		}
+	}
 public:
 	int fd;
 	T * data;
@@ -58,6 +102,21 @@ public:
 		init(path);
 	}
 	~BigVector() {
+		if (anonymous) {
+			if (anonymous_backing < 0) {
+				assert(munmap(data, anonymous_bytes)==0);
+			} else {
+				huge_free(data, anonymous_bytes, anonymous_backing);
+			}
+			BufferManager::global().release_in_memory(sizeof(T) * length);
+			if (fd != -1) close(fd);
+			return;
+		}
+		if (region != NULL) {
+			delete region;
+			close(fd);
+			return;
+		}
 		if (is_open && file_exists(path)) {
 			close_mmap();
 		}
@@ -70,6 +129,10 @@ public:
 	void init(std::string path, size_t length) {
 		this->path = path;
 		this->length = length;
+		if (BufferManager::global().reserve_in_memory(sizeof(T) * length)) {
+			init_anonymous();
+			return;
+		}
 		if (!file_exists(path)) {
 			FILE * fout = fopen(path.c_str(), "wb");
 			fclose(fout);
@@ -79,7 +142,9 @@ public:
 			assert(truncate(path.c_str(), file_length)!=-1);
 			int fout = open(path.c_str(), O_WRONLY);
 			void * buffer = memalign(PAGESIZE, PAGESIZE);
-			for (long offset=0;offset<file_length;) {
+			// 能fallocate时直接分配（读出来是0），不用一页页写0
+			long offset = (file_length == 0 || fallocate(fout, 0, 0, file_length) == 0) ? file_length : 0;
+			for (;offset<file_length;) {
 				if (file_length - offset > PAGESIZE) {
 					assert(write(fout, buffer, PAGESIZE)==PAGESIZE);
 					offset += PAGESIZE;
@@ -93,7 +158,67 @@ public:
 		}
 		fd = open(path.c_str(), O_RDWR | O_DIRECT);
 		assert(fd!=-1);
-		open_mmap();
+		if (BufferManager::global().enabled() && DIRTYCHUNKSIZE % sizeof(T) == 0) {
+			region = new PagedRegion(fd, sizeof(T) * length, &BufferManager::global());
+			data = (T *)region->data;
+			is_open = true;
+		} else {
+			dirty.init(sizeof(T) * length);
+			open_mmap();
+		}
+	}
+	void init_anonymous() {
+		anonymous = true;
+		fd = -1;
+		long bytes = sizeof(T) * length;
+		anonymous_bytes = std::max(bytes, 1l);
+		dirty.init(bytes);
+		if (bytes > 0 && file_exists(path) && file_size(path) == bytes) {
+			int fin = open(path.c_str(), O_RDONLY);
+			assert(fin!=-1);
+			data = (T *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fin, 0);
+			assert(data!=MAP_FAILED);
+			close(fin);
+			anonymous_backing = -1;
+			file_backed = true;
+		} else {
+			data = (T *)huge_alloc(anonymous_bytes, "vertex data", anonymous_backing);
+			interleave_memory(data, anonymous_bytes);
+			file_backed = false;
+		}
+		is_open = true;
+	}
+	bool paged() {
+		return region != NULL;
+	}
+	bool in_ram() {
+		return anonymous;
+	}
+	/**
+	 * @brief 把内容写进文件。匿名模式下点数据只在内存里，只有checkpoint才会落盘：第一次写整个vector，之后只写脏块；其余模式等同sync()。
+	 */
+	void checkpoint() {
+		if (!anonymous) {
+			sync();
+			return;
+		}
+		long bytes = sizeof(T) * length;
+		if (fd == -1) {
+			fd = open(path.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
+			assert(fd!=-1);
+		}
+		if (!file_backed) {
+			assert(ftruncate(fd, bytes)==0);
+			dirty.mark_all();
+			file_backed = true;
+		}
+		std::pair<long, long> cont(0, 0);
+		auto write_run = [&](long begin_byte, long end_byte) {
+			end_byte = std::min(end_byte, bytes);
+			if (end_byte > begin_byte) write_range(fd, (char *)data + begin_byte, begin_byte, end_byte - begin_byte, bytes);
+		};
+		dirty.take_runs(0, dirty.count(), cont, write_run);
+		dirty.finish(cont, write_run);
 	}
 	void open_mmap() {
 		int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
@@ -104,7 +229,7 @@ public:
 		is_open = true;
 	}
 	void print_address(const char* msg){
-		unsigned long end_p = (unsigned long )(void*)(data + length));
+		unsigned long end_p = (unsigned long )(void*)(data + length);
 		util::print_address(msg,(unsigned long)(void*)data,end_p);
 	}
 	void close_mmap() {
@@ -113,30 +238,79 @@ public:
 		assert(ret==0);
 	}
 	void fill(const T & value) {
-		int parallelism = std::thread::hardware_concurrency();
-		#pragma omp parallel num_threads(parallelism)
-		{
-			size_t begin_i, end_i;
-			std::tie(begin_i, end_i) = get_partition_range(length, omp_get_num_threads(), omp_get_thread_num());
+		if (region != NULL) {
+			// 整页覆盖，不用先读文件；每批页填完后换出超出budget的部分
+			long pages = region->page_count();
+			long batch = std::max(1l, BufferManager::global().get_budget() / 2 / VERTEXPAGESIZE);
+			for (long begin_page=0;begin_page<pages;begin_page+=batch) {
+				long end_page = std::min(pages, begin_page + batch);
+				ThreadPool::parallel_range(end_page - begin_page, [&](size_t begin_p, size_t end_p) {
+					for (long p=begin_page+begin_p;p<begin_page+(long)end_p;p++) {
+						region->fault(p, false);
+						region->mark_dirty(p);
+						size_t end_i = std::min(length, (p + 1) * PAGE_ELEMENTS);
+						for (size_t i=p*PAGE_ELEMENTS;i<end_i;i++) {
+							data[i] = value;
+						}
+					}
+				});
+				BufferManager::global().balance();
+			}
+			return;
+		}
+		dirty.mark_all();
+		ThreadPool::parallel_range(length, [&](size_t begin_i, size_t end_i) {
 			for (size_t i=begin_i;i<end_i;i++) {
 				data[i] = value;
 			}
-		}
-		#pragma omp barrier
+		});
 	}
+	// 写访问：把所在的块记为脏块（cas/write_add也要通过它取地址）。只读的地方用get()，不然读过的块也会被写回
 	T & operator[](size_t i) {
-		if (in_memory) {
-			if (!(i >= begin_i && i <= end_i)) {
-				printf("%s %lu %lu %lu\n", path.c_str(), begin_i, i, end_i);
-				exit(-1);
-			}
-			return data_in_memory[i - begin_i];
-		} else {
+		if (region != NULL) {
+			region->touch_write(i / PAGE_ELEMENTS, chunk_of(i));
+			return data[i];
+		}
+		mark_dirty(i);
+		return at(i);
+	}
+	// 只读访问，不把所在的块记为脏块
+	const T & get(size_t i) {
+		if (region != NULL) {
+			region->touch(i / PAGE_ELEMENTS);
 			return data[i];
 		}
+		return at(i);
 	}
 	void sync() {
-		assert(msync(data, sizeof(T) * length, MS_SYNC)==0);
+		if (anonymous) {
+			checkpoint();
+			return;
+		}
+		if (region != NULL) {
+			region->flush(0, region->page_count());
+			return;
+		}
+		// 只msync写过的块
+		long file_bytes = sizeof(T) * length;
+		std::pair<long, long> cont(0, 0);
+		auto sync_run = [&](long begin_byte, long end_byte) {
+			end_byte = std::min(end_byte, file_bytes);
+			if (end_byte > begin_byte) assert(msync((char *)data + begin_byte, end_byte - begin_byte, MS_SYNC)==0);
+		};
+		dirty.take_runs(0, dirty.count(), cont, sync_run);
+		dirty.finish(cont, sync_run);
+	}
+	// 把[begin_i, end_i)固定在内存里直到unpin；不分页时什么都不做
+	void pin(size_t begin_i, size_t end_i) {
+		if (region == NULL || begin_i >= end_i) return;
+		region->pin(first_page(begin_i), last_page(end_i));
+		BufferManager::global().balance();
+	}
+	void unpin(size_t begin_i, size_t end_i) {
+		if (region == NULL || begin_i >= end_i) return;
+		region->unpin(first_page(begin_i), last_page(end_i));
+		BufferManager::global().balance();
 	}
 	void lock(size_t begin_i, size_t end_i) {
 		assert(mlock(data + begin_i, (end_i - begin_i) * sizeof(T))==0);
@@ -145,6 +319,15 @@ public:
 		assert(munlock(data + begin_i, (end_i - begin_i) * sizeof(T))==0);
 	}
 	void load(size_t begin_i, size_t end_i) {
+		// 整个都在内存里，不需要窗口
+		if (anonymous) return;
+		if (region != NULL) {
+			windows.push_back(std::make_pair(begin_i, end_i));
+			pin(begin_i, end_i);
+			return;
+		}
+		// 下面用O_DIRECT读，先把mmap里写过的块刷下去
+		sync();
 		close_mmap();
 		begin_i = begin_i * sizeof(T) / PAGESIZE * PAGESIZE / sizeof(T);
 		this->begin_i = begin_i;
@@ -152,8 +335,7 @@ public:
 		in_memory = true;
 		// data_in_memory = (T *)memalign(PAGESIZE, (end_i - begin_i) * sizeof(T) + PAGESIZE);
 		// assert(data_in_memory!=NULL);
-		data_in_memory = (T *)mmap(0, (end_i - begin_i) * sizeof(T) + PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		assert(data_in_memory!=MAP_FAILED);
+		data_in_memory = (T *)huge_alloc((end_i - begin_i) * sizeof(T) + PAGESIZE, "vertex window", window_backing);
 		long end_offset = end_i * sizeof(T);
 		long offset = begin_i * sizeof(T);
 		long bytes;
@@ -169,21 +351,32 @@ public:
 		}
 	}
 	void save() {
-		long end_offset = end_i * sizeof(T);
-		long offset = begin_i * sizeof(T);
-		long bytes;
-		while (offset < end_offset) {
-			bytes = pwrite(fd, data_in_memory + (offset / sizeof(T) - begin_i), (end_offset - offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE, offset);
-			if (bytes==-1) {
-				printf("%ld %ld\n", offset, end_offset);
-				printf("%s\n", strerror(errno));
-				getchar();
-				exit(-1);
+		if (anonymous) return;
+		if (region != NULL) {
+			assert(!windows.empty());
+			size_t begin_i, end_i;
+			std::tie(begin_i, end_i) = windows.front();
+			windows.pop_front();
+			if (begin_i < end_i) {
+				region->unpin(first_page(begin_i), last_page(end_i));
+				// 和后一个窗口共用的边界页还被pin着，可能正在被写，等后一个窗口save时再写回
+				region->flush(first_page(begin_i), last_page(end_i), true);
+				BufferManager::global().balance();
 			}
-			offset += bytes;
+			return;
 		}
-		int ret = munmap(data_in_memory, (end_i - begin_i) * sizeof(T) + PAGESIZE);
-		assert(ret==0);
+		// 只写回窗口里的脏块，相邻的合并成一次写
+		long begin_offset = begin_i * sizeof(T);
+		long end_offset = end_i * sizeof(T);
+		std::pair<long, long> cont(0, 0);
+		auto write_run = [&](long begin_byte, long end_byte) {
+			begin_byte = std::max(begin_byte, begin_offset);
+			end_byte = std::min(end_byte, end_offset);
+			if (end_byte > begin_byte) write_range(fd, (char *)data_in_memory + (begin_byte - begin_offset), begin_byte, end_byte - begin_byte, sizeof(T) * length);
+		};
+		dirty.take_runs(begin_offset / DIRTYCHUNKSIZE, (end_offset + DIRTYCHUNKSIZE - 1) / DIRTYCHUNKSIZE, cont, write_run);
+		dirty.finish(cont, write_run);
+		huge_free(data_in_memory, (end_i - begin_i) * sizeof(T) + PAGESIZE, window_backing);
 		in_memory = false;
 		begin_i = 0;
 		end_i = 0;
@@ -17,6 +17,8 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #ifndef BITMAP_H
 #define BITMAP_H
 #include "core/util.hpp"
+#include "core/threadpool.hpp"
+#include "core/hugepage.hpp"
 #define WORD_OFFSET(i) (i >> 6)
 #define BIT_OFFSET(i) (i & 0x3f)
 
@@ -24,6 +26,7 @@ class Bitmap {
 public:
 	size_t size;
 	unsigned long * data;
+	int backing;
 	Bitmap() {
 		size = 0;
 		data = NULL;
@@ -33,8 +36,8 @@ public:
 	}
 	void init(size_t size) {
 		this->size = size;
-		data = new unsigned long [WORD_OFFSET(size)+1];
-		memset(data,0,sizeof(long)*(WORD_OFFSET(size)+1));
+		// 大的bitmap放在大页上，get_bit的随机访问少些TLB miss；匿名映射已经清零
+		data = (unsigned long *)huge_alloc(sizeof(long)*(WORD_OFFSET(size)+1), "bitmap", backing);
 	}
 	void print_address(){
 		unsigned long * end_p = data+WORD_OFFSET(size)+1;
@@ -42,19 +45,19 @@ public:
 	}
 	void clear() {
 		size_t bm_size = WORD_OFFSET(size);
-		#pragma omp parallel for
-		for (size_t i=0;i<=bm_size;i++) {
-			data[i] = 0;
-		}
-		#pragma omp barrier
+		ThreadPool::parallel_range(bm_size + 1, [&](size_t begin_i, size_t end_i) {
+			for (size_t i=begin_i;i<end_i;i++) {
+				data[i] = 0;
+			}
+		});
 	}
 	void fill() {
 		size_t bm_size = WORD_OFFSET(size);
-		#pragma omp parallel for
-		for (size_t i=0;i<bm_size;i++) {
-			data[i] = 0xffffffffffffffff;
-		}
-		#pragma omp barrier
+		ThreadPool::parallel_range(bm_size, [&](size_t begin_i, size_t end_i) {
+			for (size_t i=begin_i;i<end_i;i++) {
+				data[i] = 0xffffffffffffffff;
+			}
+		});
 		data[bm_size] = 0;
 		for (size_t i=(bm_size<<6);i<size;i++) {
 			data[bm_size] |= 1ul << BIT_OFFSET(i);
@@ -0,0 +1,390 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BUFFERMANAGER_H
+#define BUFFERMANAGER_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "core/constants.hpp"
+#include "core/hugepage.hpp"
+
+class PagedRegion;
+
+/**
+ * @brief 点数据的缓冲区管理器（进程内一个）。分页的BigVector按VERTEXPAGESIZE的页读进内存，常驻的页总量由budget限制，
+ * 超出时用clock算法换出没被pin的页，脏页先写回文件。换出只发生在balance()里，调用方要保证这时没有worker在访问点数据
+ * （pin/unpin、load/save、fill、stream_edges/stream_vertices的窗口之间），或者用hold()推迟；两次balance之间常驻量可能暂时超过budget。
+ * 整个放在匿名内存里的BigVector（reserve_in_memory）也计入budget。
+ */
+class BufferManager {
+	long budget;
+	std::atomic<long> resident;
+	std::atomic<long> in_memory; // 不分页、整个放在内存里的BigVector
+	std::mutex mutex;
+	std::vector<std::pair<PagedRegion *, long>> frames; // 常驻的页，clock的表盘
+	size_t hand;
+	std::atomic<int> holds;
+public:
+	std::atomic<long> faults;
+	std::atomic<long> evictions;
+	std::atomic<long> written_bytes;
+	BufferManager() : budget(0), hand(0) {
+		resident.store(0);
+		in_memory.store(0);
+		holds.store(0);
+		faults.store(0);
+		evictions.store(0);
+		written_bytes.store(0);
+	}
+	static BufferManager & global() {
+		static BufferManager manager;
+		return manager;
+	}
+	// budget为0时不分页，BigVector退回整个文件mmap
+	void set_budget(long budget) {
+		this->budget = budget;
+	}
+	long get_budget() {
+		return budget;
+	}
+	bool enabled() {
+		return budget > 0;
+	}
+	long resident_bytes() {
+		return resident.load();
+	}
+	/**
+	 * @brief 一个bytes字节的BigVector能不能整个放在内存里：加上已经这样放的和常驻的页不超过budget的80%（和Graph判断点数据放不放得下一样）。
+	 * 能的话把这部分算进去并返回true，BigVector释放时调用release_in_memory。
+	 */
+	bool reserve_in_memory(long bytes) {
+		if (!enabled()) return false;
+		long used = in_memory.load();
+		while (used + resident.load() + bytes <= 0.8 * budget) {
+			if (in_memory.compare_exchange_weak(used, used + bytes)) return true;
+		}
+		return false;
+	}
+	void release_in_memory(long bytes) {
+		in_memory -= bytes;
+	}
+	// hold()和release()之间balance()不换页，用于后台线程读写窗口、worker同时在访问点数据的时候
+	void hold() {
+		holds++;
+	}
+	void release() {
+		holds--;
+	}
+	inline void admit(PagedRegion * region, long page);
+	inline void forget(PagedRegion * region);
+	inline void balance();
+};
+
+/**
+ * @brief 按DIRTYCHUNKSIZE字节一块记录哪些块被写过，写回时只写脏块，相邻的脏块合并成一次写。
+ */
+class DirtyChunks {
+	std::atomic<char> * flags;
+	long chunks;
+public:
+	DirtyChunks() : flags(NULL), chunks(0) { }
+	~DirtyChunks() {
+		delete [] flags;
+	}
+	void init(long bytes) {
+		delete [] flags;
+		chunks = std::max(1l, (bytes + DIRTYCHUNKSIZE - 1) / DIRTYCHUNKSIZE);
+		flags = new std::atomic<char> [chunks];
+		for (long c=0;c<chunks;c++) {
+			flags[c].store(0);
+		}
+	}
+	bool ready() {
+		return flags != NULL;
+	}
+	long count() {
+		return chunks;
+	}
+	inline void mark(long chunk) {
+		if (!flags[chunk].load(std::memory_order_relaxed)) flags[chunk].store(1, std::memory_order_relaxed);
+	}
+	void mark_all() {
+		for (long c=0;c<chunks;c++) {
+			flags[c].store(1, std::memory_order_relaxed);
+		}
+	}
+	/**
+	 * @brief 对[begin_chunk, end_chunk)里连续的脏块调用f(begin_byte, end_byte)，并清掉它们的标记。
+	 * cont里保存上一次调用末尾还没交给f的一段，跨多次调用的相邻脏块也能合并；最后要调用finish(cont, f)。
+	 */
+	template <typename F>
+	void take_runs(long begin_chunk, long end_chunk, std::pair<long, long> & cont, F f) {
+		for (long c=begin_chunk;c<end_chunk;c++) {
+			if (!flags[c].load(std::memory_order_relaxed)) continue;
+			flags[c].store(0, std::memory_order_relaxed);
+			if (cont.first < cont.second && cont.second==c) {
+				cont.second = c + 1;
+			} else {
+				finish(cont, f);
+				cont = std::make_pair(c, c + 1);
+			}
+		}
+	}
+	template <typename F>
+	void finish(std::pair<long, long> & cont, F f) {
+		if (cont.first < cont.second) f(cont.first * DIRTYCHUNKSIZE, cont.second * DIRTYCHUNKSIZE);
+		cont = std::make_pair(0l, 0l);
+	}
+};
+
+// 把buffer写到fd的[offset, offset+bytes)，长度按4KB向上对齐（O_DIRECT），写过文件末尾时截回file_bytes
+inline void write_range(int fd, const char * buffer, long offset, long bytes, long file_bytes) {
+	long aligned_bytes = (bytes + 4095) / 4096 * 4096;
+	long done = 0;
+	while (done < aligned_bytes) {
+		long ret = pwrite(fd, buffer + done, aligned_bytes - done, offset + done);
+		if (ret==-1 && errno==EINTR) continue;
+		if (ret==-1) {
+			fprintf(stderr, "vertex data write failed: %s\n", strerror(errno));
+			exit(-1);
+		}
+		done += ret;
+	}
+	if (offset + aligned_bytes > file_bytes) {
+		assert(ftruncate(fd, file_bytes)==0);
+	}
+}
+
+struct PageFrame {
+	static const char ABSENT = 0;
+	static const char LOADING = 1;
+	static const char RESIDENT = 2;
+	std::atomic<char> state;
+	std::atomic<char> referenced;
+	std::atomic<char> dirty; // 页里有脏块
+	std::atomic<int> pins;
+};
+
+/**
+ * @brief 一个点数据文件的分页视图。整个文件对应一段连续的匿名虚拟地址（MAP_NORESERVE，不占内存），
+ * 页第一次被访问时从文件读进对应位置，换出时写回并MADV_DONTNEED释放，所以元素地址在换入换出之间不变。
+ * 写回只写页里的脏块（DIRTYCHUNKSIZE），相邻页的脏块连在一起时合并写。
+ * 这段地址按2MB对齐，能用透明大页或2MB的hugetlb页时一个大页正好是一页（不用1GB页，换出时要按页释放）。
+ */
+class PagedRegion {
+	static const long CHUNKS_PER_PAGE = VERTEXPAGESIZE / DIRTYCHUNKSIZE;
+	int fd;
+	long file_bytes;
+	long pages;
+	PageFrame * frames;
+	DirtyChunks dirty;
+	BufferManager * manager;
+
+	long page_bytes(long page) {
+		return std::min((long)VERTEXPAGESIZE, file_bytes - page * VERTEXPAGESIZE);
+	}
+	void read_page(long page) {
+		long offset = page * VERTEXPAGESIZE;
+		long bytes = page_bytes(page);
+		// O_DIRECT要求长度按4KB对齐，文件末尾的短读就是读完了
+		long aligned_bytes = (bytes + 4095) / 4096 * 4096;
+		long done = 0;
+		while (done < bytes) {
+			long ret = pread(fd, data + offset + done, aligned_bytes - done, offset + done);
+			if (ret==-1 && errno==EINTR) continue;
+			if (ret==-1) {
+				fprintf(stderr, "vertex page read failed: %s\n", strerror(errno));
+				exit(-1);
+			}
+			if (ret==0) break;
+			done += ret;
+		}
+	}
+	void write_run(long begin_byte, long end_byte) {
+		end_byte = std::min(end_byte, file_bytes);
+		if (end_byte <= begin_byte) return;
+		write_range(fd, data + begin_byte, begin_byte, end_byte - begin_byte, file_bytes);
+		manager->written_bytes += end_byte - begin_byte;
+	}
+public:
+	char * data;
+	long reserved_bytes;
+	int backing;
+	PagedRegion(int fd, long file_bytes, BufferManager * manager) : fd(fd), file_bytes(file_bytes), manager(manager) {
+		pages = (file_bytes + VERTEXPAGESIZE - 1) / VERTEXPAGESIZE;
+		if (pages==0) pages = 1;
+		reserved_bytes = pages * VERTEXPAGESIZE;
+		data = (char *)huge_alloc(reserved_bytes, "vertex data", backing, PAGES_HUGETLB_2M, true);
+		frames = new PageFrame [pages];
+		for (long p=0;p<pages;p++) {
+			frames[p].state.store(PageFrame::ABSENT);
+			frames[p].referenced.store(0);
+			frames[p].dirty.store(0);
+			frames[p].pins.store(0);
+		}
+		dirty.init(reserved_bytes);
+	}
+	~PagedRegion() {
+		flush(0, pages);
+		manager->forget(this);
+		delete [] frames;
+		huge_free(data, reserved_bytes, backing);
+	}
+	long page_count() {
+		return pages;
+	}
+	// 读第page页之前调用
+	inline void touch(long page) {
+		PageFrame & frame = frames[page];
+		if (frame.state.load(std::memory_order_acquire)!=PageFrame::RESIDENT) {
+			fault(page, true);
+		}
+		if (!frame.referenced.load(std::memory_order_relaxed)) frame.referenced.store(1, std::memory_order_relaxed);
+	}
+	// 写第page页的第chunk块（整个文件里的块号）之前调用
+	inline void touch_write(long page, long chunk) {
+		touch(page);
+		PageFrame & frame = frames[page];
+		if (!frame.dirty.load(std::memory_order_relaxed)) frame.dirty.store(1, std::memory_order_relaxed);
+		dirty.mark(chunk);
+	}
+	// 把页换进来；read为false时不读文件（调用方马上要整页覆盖）。多个线程同时缺同一页时只有一个去读，其余等它
+	void fault(long page, bool read) {
+		PageFrame & frame = frames[page];
+		char expected = PageFrame::ABSENT;
+		if (frame.state.compare_exchange_strong(expected, PageFrame::LOADING)) {
+			if (read) read_page(page);
+			manager->faults++;
+			manager->admit(this, page);
+			frame.state.store(PageFrame::RESIDENT, std::memory_order_release);
+			return;
+		}
+		while (frame.state.load(std::memory_order_acquire)!=PageFrame::RESIDENT) {
+			std::this_thread::yield();
+		}
+	}
+	void pin(long begin_page, long end_page) {
+		for (long p=begin_page;p<end_page;p++) {
+			frames[p].pins++;
+			touch(p);
+		}
+	}
+	void unpin(long begin_page, long end_page) {
+		for (long p=begin_page;p<end_page;p++) {
+			int pins = --frames[p].pins;
+			assert(pins>=0);
+		}
+	}
+	bool pinned(long page) {
+		return frames[page].pins.load() > 0;
+	}
+	// 整页都要写（fill）
+	void mark_dirty(long page) {
+		frames[page].dirty.store(1);
+		for (long c=page*CHUNKS_PER_PAGE;c<(page+1)*CHUNKS_PER_PAGE;c++) {
+			dirty.mark(c);
+		}
+	}
+	// clock用：清掉引用位，返回清之前的值
+	bool test_and_clear_referenced(long page) {
+		return frames[page].referenced.exchange(0);
+	}
+	bool resident(long page) {
+		return frames[page].state.load()==PageFrame::RESIDENT;
+	}
+	// 写回[begin_page, end_page)里的脏块，页仍然常驻；skip_pinned为true时跳过还被pin着的页
+	void flush(long begin_page, long end_page, bool skip_pinned = false) {
+		std::pair<long, long> cont(0, 0);
+		auto write = [&](long begin_byte, long end_byte) {
+			write_run(begin_byte, end_byte);
+		};
+		for (long p=begin_page;p<end_page;p++) {
+			PageFrame & frame = frames[p];
+			if (frame.state.load()!=PageFrame::RESIDENT || !frame.dirty.load() || (skip_pinned && frame.pins.load() > 0)) continue;
+			frame.dirty.store(0);
+			dirty.take_runs(p * CHUNKS_PER_PAGE, (p + 1) * CHUNKS_PER_PAGE, cont, write);
+		}
+		dirty.finish(cont, write);
+	}
+	// 写回并释放一页，返回释放的字节数
+	long evict(long page) {
+		PageFrame & frame = frames[page];
+		if (frame.state.load()!=PageFrame::RESIDENT || frame.pins.load() > 0) return 0;
+		flush(page, page + 1);
+		assert(madvise(data + page * VERTEXPAGESIZE, VERTEXPAGESIZE, MADV_DONTNEED)==0);
+		frame.referenced.store(0);
+		frame.state.store(PageFrame::ABSENT);
+		return VERTEXPAGESIZE;
+	}
+};
+
+void BufferManager::admit(PagedRegion * region, long page) {
+	std::unique_lock<std::mutex> lock(mutex);
+	frames.push_back(std::make_pair(region, page));
+	resident += VERTEXPAGESIZE;
+}
+
+void BufferManager::forget(PagedRegion * region) {
+	std::unique_lock<std::mutex> lock(mutex);
+	size_t kept = 0;
+	for (size_t k=0;k<frames.size();k++) {
+		if (frames[k].first==region) {
+			resident -= VERTEXPAGESIZE;
+		} else {
+			frames[kept++] = frames[k];
+		}
+	}
+	frames.resize(kept);
+	hand = 0;
+}
+
+void BufferManager::balance() {
+	if (!enabled() || holds.load() > 0) return;
+	std::unique_lock<std::mutex> lock(mutex);
+	// 转两圈还换不出来说明剩下的都被pin住了
+	size_t idle = 0;
+	while (resident.load() + in_memory.load() > budget && !frames.empty() && idle < 2 * frames.size()) {
+		if (hand >= frames.size()) hand = 0;
+		PagedRegion * region = frames[hand].first;
+		long page = frames[hand].second;
+		if (region->pinned(page) || region->test_and_clear_referenced(page)) {
+			hand++;
+			idle++;
+			continue;
+		}
+		resident -= region->evict(page);
+		evictions++;
+		frames[hand] = frames.back();
+		frames.pop_back();
+		idle = 0;
+	}
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string.h>
+
+#include "core/constants.hpp"
+#include "core/type.hpp"
+
+/**
+ * @brief preprocess -c写出的压缩grid（row_compressed/column_compressed）由一串chunk组成，每个chunk最多COMPRESSEDCHUNK条边，
+ * 不跨block。chunk以ChunkHeader开头，后面依次是每条边source和target（和grid一样宽的点id）相对上一条边的差（zigzag + varint），
+ * 带权图最后是edges个原始的Weight。每个chunk可以单独解码。
+ */
+struct ChunkHeader {
+	int edges;
+	int bytes; // header之后的字节数
+};
+
+// 一个chunk编码后最多占的字节数：每条边两个zigzag后的差值，各占VID的位宽加一位（符号）按7位一字节的varint
+template <typename VID>
+inline long max_chunk_bytes(int edges) {
+	return sizeof(ChunkHeader) + (long)edges * (2 * ((sizeof(VID) * 8 + 1 + 6) / 7) + sizeof(Weight));
+}
+
+inline char * encode_varint(char * p, unsigned long value) {
+	while (value >= 0x80) {
+		*p++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (char)value;
+	return p;
+}
+
+inline const char * decode_varint(const char * p, unsigned long & value) {
+	value = 0;
+	int shift = 0;
+	while (*(const unsigned char *)p >= 0x80) {
+		value |= (unsigned long)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	value |= (unsigned long)*(const unsigned char *)p++ << shift;
+	return p;
+}
+
+inline unsigned long zigzag(long delta) {
+	return (unsigned long)((delta << 1) ^ (delta >> 63));
+}
+
+inline long unzigzag(unsigned long value) {
+	return (long)(value >> 1) ^ -(long)(value & 1);
+}
+
+// 把count条原始格式（edge_unit字节一条）的边编码成一个chunk写到out，返回chunk的总字节数
+template <typename VID>
+inline long encode_chunk(const char * edges, int count, int edge_unit, char * out) {
+	char * p = out + sizeof(ChunkHeader);
+	VID prev_source = 0, prev_target = 0;
+	for (int k=0;k<count;k++) {
+		VID source = *(const VID *)(edges + (long)k * edge_unit);
+		VID target = *(const VID *)(edges + (long)k * edge_unit + sizeof(VID));
+		p = encode_varint(p, zigzag((long)source - prev_source));
+		p = encode_varint(p, zigzag((long)target - prev_target));
+		prev_source = source;
+		prev_target = target;
+	}
+	if (edge_unit > (int)sizeof(VID) * 2) {
+		for (int k=0;k<count;k++) {
+			memcpy(p, edges + (long)k * edge_unit + sizeof(VID) * 2, sizeof(Weight));
+			p += sizeof(Weight);
+		}
+	}
+	ChunkHeader header;
+	header.edges = count;
+	header.bytes = p - out - sizeof(ChunkHeader);
+	memcpy(out, &header, sizeof(ChunkHeader));
+	return p - out;
+}
+
+// 把in处的一个chunk解码到out（至少COMPRESSEDCHUNK个Edge），chunk_bytes返回chunk的总字节数，返回边数。无权图的weight为0
+template <typename VID>
+inline int decode_chunk(const char * in, EdgeT<VID> * out, bool weighted, long & chunk_bytes) {
+	ChunkHeader header;
+	memcpy(&header, in, sizeof(ChunkHeader));
+	const char * p = in + sizeof(ChunkHeader);
+	long source = 0, target = 0;
+	unsigned long value;
+	for (int k=0;k<header.edges;k++) {
+		p = decode_varint(p, value);
+		source += unzigzag(value);
+		p = decode_varint(p, value);
+		target += unzigzag(value);
+		out[k].source = source;
+		out[k].target = target;
+		out[k].weight = 0;
+	}
+	if (weighted) {
+		for (int k=0;k<header.edges;k++) {
+			memcpy(&out[k].weight, p, sizeof(Weight));
+			p += sizeof(Weight);
+		}
+	}
+	chunk_bytes = sizeof(ChunkHeader) + header.bytes;
+	return header.edges;
+}
+
+#endif
@@ -20,5 +20,39 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #define CHUNKSIZE 1048576
 // #define PAGESIZE 4096
 #define IOSIZE 1048576 * 24
+// granularity of the per-region source summaries (a multiple of both edge sizes and both page sizes)
+#define SUMMARYSIZE (12288 * 32)
+
+// edge streaming I/O backends
+#define IO_MMAP 0
+#define IO_PREAD 1
+#define IO_AIO 2
+#define IODEPTH 8
+// preprocess scatters edges per block up to this many partitions; larger grids shuffle through at most MAXBUCKETS bucket files
+#define SCATTERPARTITIONS 256
+#define MAXBUCKETS 256
+// per-thread write-combining buffer of the preprocess scatter, split evenly among the blocks it writes to
+#define SCATTERBUFFER ((long)IOSIZE * 2)
+// smallest share of that buffer per block when writing a bucket; buckets with more blocks are written in several passes
+#define SCATTERSLOT 4096
+// buckets of the per-block source degree histogram: [1], [2,3], [4,7], ..., [2^(DEGREEBUCKETS-1), inf)
+#define DEGREEBUCKETS 8
+// tasks a streaming worker takes from the queue at once
+#define TASKBATCH 8
+// edges per independently decodable chunk of a compressed grid
+#define COMPRESSEDCHUNK 65536
+// edge property columns a stream_edges callback reads (bit k = column k); column 0 is Edge::weight
+#define PROPERTY_NONE 0
+#define PROPERTY_WEIGHT 1
+#define PROPERTY_ALL (~0)
+// page size of the vertex data buffer manager
+#define VERTEXPAGESIZE (1l << 21)
+// granularity of vertex data dirty tracking; only dirty chunks are written back
+#define DIRTYCHUNKSIZE (1l << 16)
+// pages backing large anonymous allocations (vertex data, bitmaps, I/O buffers)
+#define PAGES_SMALL 0
+#define PAGES_THP 1
+#define PAGES_HUGETLB_2M 2
+#define PAGES_HUGETLB_1G 3
 
 #endif
@@ -22,48 +22,123 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #include <math.h>
 #include <unistd.h>
 #include <malloc.h>
-#include <omp.h>
 #include <string.h>
 
+#include <algorithm>
+#include <functional>
 #include <thread>
 #include <vector>
+#include <unordered_map>
 
 #include "core/constants.hpp"
 #include "core/type.hpp"
 #include "core/bitmap.hpp"
 #include "core/atomic.hpp"
 #include "core/queue.hpp"
+#include "core/threadpool.hpp"
 #include "core/partition.hpp"
 #include "core/bigvector.hpp"
+#include "core/hugepage.hpp"
+#include "core/aio.hpp"
+#include "core/compress.hpp"
 #include "core/time.hpp"
 
-bool f_true(VertexId v)
+template <typename VID = VertexId>
+bool f_true(VID v)
 {
 	return true;
 }
 
-void f_none_1(std::pair<VertexId, VertexId> vid_range)
+template <typename VID = VertexId>
+void f_none_1(std::pair<VID, VID> vid_range)
 {
 }
 
-void f_none_2(std::pair<VertexId, VertexId> source_vid_range, std::pair<VertexId, VertexId> target_vid_range)
+template <typename VID = VertexId>
+void f_none_2(std::pair<VID, VID> source_vid_range, std::pair<VID, VID> target_vid_range)
 {
 }
 
-class Graph
+// type of the default window hooks, so that hooks which are not passed need no std::function either
+template <typename VID>
+using VidRangeHookT = void (*)(std::pair<VID, VID>);
+typedef VidRangeHookT<VertexId> VidRangeHook;
+
+// grid的点id字节数，记在meta的第五项里，旧的grid没有这一项时是4
+inline int vertex_id_bytes(std::string path)
+{
+	int edge_type, partitions, id_bytes = 4;
+	long vertices, edges;
+	FILE *fin_meta = fopen((path + "/meta").c_str(), "r");
+	assert(fin_meta != NULL);
+	fscanf(fin_meta, "%d %ld %ld %d %d", &edge_type, &vertices, &edges, &partitions, &id_bytes);
+	fclose(fin_meta);
+	return id_bytes;
+}
+
+/**
+ * @brief 模板参数是点id的类型（int或long），类里的VertexId、Edge、BlockStats、PartitionMap都是这个宽度的版本。
+ * Graph是32位id的默认版本，64位id的grid（preprocess -w 8）用GraphT<long>打开。
+ */
+template <typename VertexId>
+class GraphT
 {
+	typedef EdgeT<VertexId> Edge;
+	typedef BlockStatsT<VertexId> BlockStats;
+	typedef PartitionMapT<VertexId> PartitionMap;
+	typedef VidRangeHookT<VertexId> VidRangeHook;
+
 	int parallelism;
 	int edge_unit;
 	bool *should_access_shard;
-	long **fsize;
 	char **buffer_pool;
+	int buffer_pool_size;
 	long *column_offset;
 	long *row_offset;
 	long memory_bytes;
 	int partition_batch;
+	PartitionMap partition_map;
 	long vertex_data_bytes;
 	long PAGESIZE;
 	void *column_mmap_start;
+	bool zero_copy;
+	int io_mode;
+	int io_depth;
+	AsyncReader *reader;
+	ThreadPool *pool;
+	VertexId *column_summary;
+	VertexId *row_summary;
+	long *active_words;
+	BlockStats *block_stats;
+	long last_read_bytes;
+	long last_skipped_bytes;
+	bool has_sparse_index;
+	double sparse_threshold;
+	EdgeId *csr_offset;
+	VertexId *csr_neighbors;
+	Weight *csr_weights;
+	bool has_in_index;
+	VertexId *permutation; // preprocess -r：permutation[原始id] = grid里的id
+	EdgeId *csc_offset;
+	VertexId *csc_neighbors;
+	Weight *csc_weights;
+	bool has_degree;
+	VertexId *out_degrees;
+	VertexId *in_degrees;
+	bool compressed; // preprocess -c：只有压缩格式的row_compressed/column_compressed
+	long *row_stream_offset; // stream_edges实际读的文件里每个block的起点，不压缩时就是row_offset/column_offset
+	long *column_stream_offset;
+	long *row_chunk_offset; // 压缩文件里每个chunk的起点
+	long *column_chunk_offset;
+	long row_chunks;
+	long column_chunks;
+	Edge **decode_pool; // 每个worker解码一个chunk用的buffer
+	bool split_properties; // preprocess -x：row/column里只有(source, target)，weight在row_property_0/column_property_0里按同样的顺序存放
+	int property_columns;
+	char **property_pool; // pread/aio模式下每个worker读属性列用的buffer
+	void *column_property_mmap_start;
+	bool exclusive_targets;
+	bool prefetch_vertices;
 
 public:
 	std::string path;
@@ -73,23 +148,128 @@ public:
 	EdgeId edges;
 	int partitions;
 
-	Graph(std::string path)
+	GraphT(std::string path)
 	{
 		PAGESIZE = 4096;
 		parallelism = std::thread::hardware_concurrency();
-		buffer_pool = new char *[parallelism * 1];
-		for (int i = 0; i < parallelism * 1; i++)
+		pool = new ThreadPool(parallelism);
+		if (ThreadPool::shared() == nullptr)
 		{
-			buffer_pool[i] = (char *)memalign(PAGESIZE, IOSIZE);
-			assert(buffer_pool[i] != NULL);
-			memset(buffer_pool[i], 0, IOSIZE);
+			ThreadPool::shared() = pool;
 		}
+		buffer_pool_size = 0;
+		buffer_pool = NULL;
+		grow_buffer_pool(parallelism * 1);
+		io_mode = IO_MMAP;
+		io_depth = IODEPTH;
+		reader = nullptr;
 		init(path);
+		// GRIDGRAPH_IO=mmap|pread|aio, GRIDGRAPH_IO_DEPTH=n
+		const char *env_io = getenv("GRIDGRAPH_IO");
+		const char *env_io_depth = getenv("GRIDGRAPH_IO_DEPTH");
+		if (env_io != NULL)
+		{
+			int depth = (env_io_depth != NULL) ? atoi(env_io_depth) : IODEPTH;
+			if (strcmp(env_io, "pread") == 0)
+				set_io_mode(IO_PREAD, depth);
+			else if (strcmp(env_io, "aio") == 0)
+				set_io_mode(IO_AIO, depth);
+			else
+				set_io_mode(IO_MMAP, depth);
+		}
+	}
+
+	GraphT(const GraphT &) = delete;
+	GraphT &operator=(const GraphT &) = delete;
+
+	// 停掉并join线程池（是ThreadPool::shared()时一并注销）
+	~GraphT()
+	{
+		if (reader != nullptr)
+			delete reader;
+		delete pool;
+	}
+
+	void grow_buffer_pool(int size)
+	{
+		if (size <= buffer_pool_size)
+			return;
+		char **new_pool = new char *[size];
+		for (int i = 0; i < buffer_pool_size; i++)
+		{
+			new_pool[i] = buffer_pool[i];
+		}
+		for (int i = buffer_pool_size; i < size; i++)
+		{
+			int backing;
+			new_pool[i] = (char *)huge_alloc(IOSIZE, "I/O buffers", backing);
+			memset(new_pool[i], 0, IOSIZE);
+		}
+		delete[] buffer_pool;
+		buffer_pool = new_pool;
+		buffer_pool_size = size;
+	}
+
+	/**
+	 * @brief 选择stream_edges读边的方式：IO_MMAP映射整个边文件（默认），IO_PREAD每个worker同步pread到自己的buffer，
+	 * IO_AIO由主线程用Linux native AIO保持io_depth个读请求在飞，读进buffer_pool后再交给worker。图比内存大时边文件以O_DIRECT打开。
+	 */
+	void set_io_mode(int io_mode, int io_depth = IODEPTH)
+	{
+		assert(io_mode == IO_MMAP || io_mode == IO_PREAD || io_mode == IO_AIO);
+		assert(io_depth > 0);
+		this->io_mode = io_mode;
+		this->io_depth = io_depth;
+		if (reader != nullptr)
+		{
+			delete reader;
+			reader = nullptr;
+		}
+		if (io_mode == IO_AIO)
+		{
+			// io_depth个buffer在飞，每个worker手上还各有一个
+			grow_buffer_pool(parallelism + io_depth);
+			reader = new AsyncReader(io_depth);
+		}
 	}
 
+	/**
+	 * @brief 开启后stream_edges直接在mmap映射的页上遍历边，不再memcpy到线程私有的buffer_pool里。
+	 */
+	void set_zero_copy(bool zero_copy)
+	{
+		this->zero_copy = zero_copy;
+	}
+
+	/**
+	 * @brief 开启后target-oriented的stream_edges按column分配给worker：一个target partition的边同一时间只由一个worker处理，
+	 * 各worker从大到小领取还没处理的column。只有partition数不少于worker数时才启用，是否启用看targets_exclusive()。
+	 */
+	void set_exclusive_targets(bool exclusive_targets)
+	{
+		this->exclusive_targets = exclusive_targets;
+	}
+
+	// 为true时target-oriented的stream_edges里同一个e.target不会被两个线程同时更新，process可以不用cas直接写
+	bool targets_exclusive()
+	{
+		return exclusive_targets && partitions >= parallelism;
+	}
+
+	/**
+	 * @brief 分窗口的stream_vertices默认在另一个线程里提前pre下一个窗口、post上一个窗口，和当前窗口的计算重叠。
+	 * 这要求pre/post可以这样交错调用（分页的BigVector::load/save可以）；不行时关掉。
+	 */
+	void set_prefetch_vertices(bool prefetch_vertices)
+	{
+		this->prefetch_vertices = prefetch_vertices;
+	}
+
+	// 同时作为BufferManager的budget，之后创建的BigVector放得下时整个放在匿名内存里，放不下时按页管理
 	void set_memory_bytes(long memory_bytes)
 	{
 		this->memory_bytes = memory_bytes;
+		BufferManager::global().set_budget(memory_bytes);
 	}
 
 	void set_vertex_data_bytes(long vertex_data_bytes)
@@ -102,8 +282,16 @@ public:
 		this->path = path;
 
 		FILE *fin_meta = fopen((path + "/meta").c_str(), "r");
-		fscanf(fin_meta, "%d %d %ld %d", &edge_type, &vertices, &edges, &partitions);
+		long meta_vertices;
+		int id_bytes = 4;
+		fscanf(fin_meta, "%d %ld %ld %d %d", &edge_type, &meta_vertices, &edges, &partitions, &id_bytes);
 		fclose(fin_meta);
+		if (id_bytes != (int)sizeof(VertexId))
+		{
+			fprintf(stderr, "%s has %d-byte vertex ids, but is opened with %d-byte ids\n", path.c_str(), id_bytes, (int)sizeof(VertexId));
+			exit(-1);
+		}
+		vertices = meta_vertices;
 
 		if (edge_type == 0)
 		{
@@ -116,31 +304,54 @@ public:
 
 		should_access_shard = new bool[partitions];
 
+		// preprocess -e存下来的partition边界，没有时按点数均分
+		if (file_exists(path + "/partition_offset"))
+		{
+			VertexId *partition_offset = new VertexId[partitions + 1];
+			int fin_partition_offset = open((path + "/partition_offset").c_str(), O_RDONLY);
+			assert(pread_full(fin_partition_offset, (char *)partition_offset, sizeof(VertexId) * (partitions + 1), 0) == (long)sizeof(VertexId) * (partitions + 1));
+			close(fin_partition_offset);
+			partition_map.init(vertices, partitions, partition_offset);
+			delete[] partition_offset;
+		}
+		else
+		{
+			partition_map.init(vertices, partitions);
+		}
+
 		if (edge_type == 0)
 		{
 			edge_unit = sizeof(VertexId) * 2;
 		}
 		else
 		{
-			edge_unit = sizeof(VertexId) * 2 + sizeof(Weight);
+			edge_unit = sizeof(Edge);
 		}
 
-		memory_bytes = 1024l * 1024l * 1024l * 1024l; // assume RAM capacity is very large
-		partition_batch = partitions;
-		vertex_data_bytes = 0;
-
-		char filename[1024];
-		fsize = new long *[partitions];
-		for (int i = 0; i < partitions; i++)
+		// 属性列k存在row_property_k/column_property_k里，第0列是weight
+		property_columns = 0;
+		while (file_exists(path + "/row_property_" + std::to_string(property_columns)))
 		{
-			fsize[i] = new long[partitions];
-			for (int j = 0; j < partitions; j++)
+			property_columns++;
+		}
+		split_properties = edge_type == 1 && property_columns > 0;
+		property_pool = nullptr;
+		column_property_mmap_start = MAP_FAILED;
+		if (split_properties)
+		{
+			edge_unit = sizeof(VertexId) * 2;
+			property_pool = new char *[parallelism];
+			for (int i = 0; i < parallelism; i++)
 			{
-				sprintf(filename, "%s/block-%d-%d", path.c_str(), i, j);
-				fsize[i][j] = file_size(filename);
+				int backing;
+				property_pool[i] = (char *)huge_alloc(IOSIZE, "property buffers", backing);
 			}
 		}
 
+		memory_bytes = 1024l * 1024l * 1024l * 1024l; // assume RAM capacity is very large
+		partition_batch = partitions;
+		vertex_data_bytes = 0;
+
 		long bytes;
 
 		column_offset = new long[partitions * partitions + 1];
@@ -155,7 +366,445 @@ public:
 		assert(bytes == sizeof(long) * (partitions * partitions + 1));
 		close(fin_row_offset);
 
+		compressed = file_exists(path + "/row_compressed") && file_exists(path + "/column_compressed");
+		row_stream_offset = row_offset;
+		column_stream_offset = column_offset;
+		row_chunk_offset = nullptr;
+		column_chunk_offset = nullptr;
+		row_chunks = 0;
+		column_chunks = 0;
+		decode_pool = nullptr;
+		if (compressed)
+		{
+			long count;
+			row_stream_offset = load_offsets(path + "/row_compressed_offset", count);
+			assert(count == partitions * partitions + 1);
+			column_stream_offset = load_offsets(path + "/column_compressed_offset", count);
+			assert(count == partitions * partitions + 1);
+			row_chunk_offset = load_offsets(path + "/row_compressed_chunks", row_chunks);
+			column_chunk_offset = load_offsets(path + "/column_compressed_chunks", column_chunks);
+			row_chunks--;
+			column_chunks--;
+			decode_pool = new Edge *[parallelism];
+			for (int i = 0; i < parallelism; i++)
+			{
+				decode_pool[i] = new Edge[COMPRESSEDCHUNK];
+			}
+		}
+
+		column_summary = load_summary(path + "/column_summary", column_offset[partitions * partitions]);
+		row_summary = load_summary(path + "/row_summary", row_offset[partitions * partitions]);
+		active_words = nullptr;
+		block_stats = nullptr;
+		if (file_exists(path + "/block_stats"))
+		{
+			block_stats = (BlockStats *)map_file(path + "/block_stats", sizeof(BlockStats) * partitions * partitions);
+		}
+		last_read_bytes = 0;
+		last_skipped_bytes = 0;
+
+		has_sparse_index = file_exists(path + "/csr_offset") && file_exists(path + "/csr_neighbors");
+		sparse_threshold = 0.01;
+		csr_offset = nullptr;
+		csr_neighbors = nullptr;
+		csr_weights = nullptr;
+		has_in_index = file_exists(path + "/csc_offset") && file_exists(path + "/csc_neighbors");
+		csc_offset = nullptr;
+		csc_neighbors = nullptr;
+		csc_weights = nullptr;
+		has_degree = file_exists(path + "/out_degree") && file_exists(path + "/in_degree");
+		out_degrees = nullptr;
+		in_degrees = nullptr;
+		if (has_degree)
+		{
+			out_degrees = (VertexId *)map_file(path + "/out_degree", sizeof(VertexId) * vertices);
+			in_degrees = (VertexId *)map_file(path + "/in_degree", sizeof(VertexId) * vertices);
+		}
+		permutation = nullptr;
+		if (file_exists(path + "/permutation"))
+		{
+			permutation = (VertexId *)map_file(path + "/permutation", sizeof(VertexId) * vertices);
+		}
+
 		column_mmap_start = MAP_FAILED;
+		zero_copy = true;
+		exclusive_targets = false;
+		prefetch_vertices = true;
+	}
+
+	// 每个SUMMARYSIZE区间里边的source范围，旧的grid没有这个文件时返回nullptr，只按partition跳过
+	VertexId *load_summary(std::string filename, long file_bytes)
+	{
+		if (!file_exists(filename))
+			return nullptr;
+		long regions = (file_bytes + SUMMARYSIZE - 1) / SUMMARYSIZE;
+		VertexId *summary = new VertexId[regions * 2];
+		int fin = open(filename.c_str(), O_RDONLY);
+		long bytes = pread_full(fin, (char *)summary, sizeof(VertexId) * 2 * regions, 0);
+		assert(bytes == (long)sizeof(VertexId) * 2 * regions);
+		close(fin);
+		return summary;
+	}
+
+	// 读入一个long数组文件，count返回元素个数
+	long *load_offsets(std::string filename, long &count)
+	{
+		long bytes = file_size(filename);
+		count = bytes / sizeof(long);
+		long *offsets = new long[count];
+		int fin = open(filename.c_str(), O_RDONLY);
+		assert(fin != -1);
+		assert(pread_full(fin, (char *)offsets, bytes, 0) == bytes);
+		close(fin);
+		return offsets;
+	}
+
+	/**
+	 * @brief 活跃点占比低于threshold时，stream_edges改为通过preprocess -s生成的CSR索引只读活跃点的出边。threshold<=0时关闭。
+	 */
+	void set_sparse_threshold(double threshold)
+	{
+		sparse_threshold = threshold;
+	}
+
+	void *map_file(std::string filename, long bytes)
+	{
+		if (bytes == 0)
+			return nullptr;
+		int fin = open(filename.c_str(), O_RDONLY);
+		assert(fin != -1);
+		void *start = mmap(0, bytes, PROT_READ, MAP_SHARED, fin, 0);
+		assert(start != MAP_FAILED);
+		close(fin);
+		return start;
+	}
+
+	void open_sparse_index()
+	{
+		if (csr_offset != nullptr)
+			return;
+		csr_offset = (EdgeId *)map_file(path + "/csr_offset", sizeof(EdgeId) * ((long)vertices + 1));
+		csr_neighbors = (VertexId *)map_file(path + "/csr_neighbors", sizeof(VertexId) * edges);
+		if (edge_type == 1)
+		{
+			csr_weights = (Weight *)map_file(path + "/csr_weights", sizeof(Weight) * edges);
+		}
+	}
+
+	void open_in_index()
+	{
+		if (csc_offset != nullptr)
+			return;
+		csc_offset = (EdgeId *)map_file(path + "/csc_offset", sizeof(EdgeId) * ((long)vertices + 1));
+		csc_neighbors = (VertexId *)map_file(path + "/csc_neighbors", sizeof(VertexId) * edges);
+		if (edge_type == 1)
+		{
+			csc_weights = (Weight *)map_file(path + "/csc_weights", sizeof(Weight) * edges);
+		}
+	}
+
+	bool sparse_index_available()
+	{
+		return has_sparse_index;
+	}
+
+	bool in_index_available()
+	{
+		return has_in_index;
+	}
+
+	/**
+	 * @brief preprocess写出的out_degree/in_degree文件（各|V|个VertexId，grid里的id）是否存在。
+	 * 存在时应用可以直接用BigVector<VertexId>打开graph.path+"/out_degree"，不用再扫一遍边算度数。
+	 */
+	bool degree_available()
+	{
+		return has_degree;
+	}
+
+	// 需要preprocess生成的度数文件或preprocess -s生成的索引
+	EdgeId out_degree(VertexId v)
+	{
+		if (has_degree)
+			return out_degrees[v];
+		open_sparse_index();
+		return csr_offset[v + 1] - csr_offset[v];
+	}
+
+	EdgeId in_degree(VertexId v)
+	{
+		if (has_degree)
+			return in_degrees[v];
+		open_in_index();
+		return csc_offset[v + 1] - csc_offset[v];
+	}
+
+	bool relabeled()
+	{
+		return permutation != nullptr;
+	}
+
+	// 原始id在grid里的id，没有重新编号时原样返回
+	VertexId local_id(VertexId original_id)
+	{
+		return permutation != nullptr ? permutation[original_id] : original_id;
+	}
+
+	/**
+	 * @brief 把按grid里的id存放的点数据按原始id的顺序写到filename，没有重新编号时就是一份拷贝。
+	 */
+	template <typename T>
+	void restore_order(BigVector<T> &data, std::string filename)
+	{
+		BigVector<T> original(filename, vertices);
+		ThreadPool::parallel_range(vertices, [&](size_t begin_i, size_t end_i)
+								   {
+			for (size_t i = begin_i; i < end_i; i++) {
+				original[i] = data.get(local_id(i));
+			} });
+		original.sync();
+	}
+
+	/**
+	 * @brief pull方式遍历入边：对每个满足cond(target)的点（bitmap非空时只看bitmap里的点），依次把它的入边交给process，
+	 * 一旦cond(target)变为false就不再看这个点剩下的入边（比如BFS找到第一个已访问的parent）。
+	 * 有preprocess -s生成的入边索引时只读需要的入边，且每个target只由一个线程处理；
+	 * 没有时退化为按column grid做target-oriented的stream_edges，只省计算不省I/O，同一个target可能被多个线程同时处理，process需要自己用cas。
+	 */
+	template <typename T, typename Process, typename Cond>
+	T pull_edges(Process process, Cond cond, Bitmap *bitmap = nullptr, T zero = 0)
+	{
+		if (!has_in_index)
+		{
+			return stream_edges<T>([&](Edge &e)
+								   {
+				if ((bitmap != nullptr && !bitmap->get_bit(e.target)) || !cond(e.target)) return zero;
+				return process(e); },
+								   nullptr, zero, 1);
+		}
+		open_in_index();
+		T value = zero;
+		long read_bytes = 0;
+		parallel_for(0, partitions, [&](int partition_id)
+					 {
+			T local_value = zero;
+			long local_read_bytes = 0;
+			VertexId begin_vid, end_vid;
+			std::tie(begin_vid, end_vid) = partition_map.range(partition_id);
+			Edge e;
+			e.weight = 0;
+			for (VertexId v = begin_vid; v < end_vid; v++) {
+				if (bitmap != nullptr) {
+					unsigned long word = bitmap->data[WORD_OFFSET(v)] >> BIT_OFFSET(v);
+					if (word == 0) {
+						v = ((WORD_OFFSET(v) + 1) << 6) - 1;
+						continue;
+					}
+					v += __builtin_ctzl(word);
+					if (v >= end_vid) break;
+				}
+				if (!cond(v)) continue;
+				e.target = v;
+				EdgeId begin_k = csc_offset[v], end_k = csc_offset[v + 1], k;
+				for (k = begin_k; k < end_k; k++) {
+					e.source = csc_neighbors[k];
+					if (csc_weights != nullptr) e.weight = csc_weights[k];
+					local_value += process(e);
+					if (!cond(v)) {
+						k++;
+						break;
+					}
+				}
+				local_read_bytes += (k - begin_k) * edge_unit;
+			}
+			write_add(&value, local_value);
+			write_add(&read_bytes, local_read_bytes); });
+		BufferManager::global().balance();
+		last_read_bytes = read_bytes;
+		last_skipped_bytes = 0;
+		return value;
+	}
+
+	long count_active_vertices(Bitmap *bitmap)
+	{
+		long words = WORD_OFFSET(vertices) + 1;
+		int chunks = parallelism * 4;
+		long active = 0;
+		parallel_for(0, chunks, [&](int chunk)
+					 {
+			size_t begin_w, end_w;
+			std::tie(begin_w, end_w) = get_partition_range(words, chunks, chunk);
+			long count = 0;
+			for (size_t w = begin_w; w < end_w; w++) {
+				count += __builtin_popcountl(bitmap->data[w]);
+			}
+			write_add(&active, count); });
+		return active;
+	}
+
+	// 稀疏模式：按source窗口遍历bitmap里的活跃点，从CSR索引里取出它们的出边交给process
+	template <typename T, int Properties, typename Process, typename PreSourceWindow, typename PostSourceWindow>
+	T stream_sparse_edges(Process &process, Bitmap *bitmap, T zero, int update_mode,
+						  PreSourceWindow &pre_source_window, PostSourceWindow &post_source_window)
+	{
+		open_sparse_index();
+		T value = zero;
+		long read_bytes = 0;
+		int batch = (update_mode == 1) ? partition_batch : partitions;
+		for (int cur_partition = 0; cur_partition < partitions; cur_partition += batch)
+		{
+			VertexId begin_vid, end_vid;
+			begin_vid = partition_map.range(cur_partition).first;
+			if (cur_partition + batch >= partitions)
+			{
+				end_vid = vertices;
+			}
+			else
+			{
+				end_vid = partition_map.range(cur_partition + batch).first;
+			}
+			if (update_mode == 1)
+				pre_source_window(std::make_pair(begin_vid, end_vid));
+			parallel_for(cur_partition, std::min(cur_partition + batch, partitions), [&](int partition_id)
+						 {
+				T local_value = zero;
+				long local_read_bytes = 0;
+				VertexId begin_vid, end_vid;
+				std::tie(begin_vid, end_vid) = partition_map.range(partition_id);
+				Edge e;
+				e.weight = 0;
+				VertexId i = begin_vid;
+				while (i < end_vid) {
+					unsigned long word = bitmap->data[WORD_OFFSET(i)] >> BIT_OFFSET(i);
+					if (word == 0) {
+						i = (WORD_OFFSET(i) + 1) << 6;
+						continue;
+					}
+					i += __builtin_ctzl(word);
+					if (i >= end_vid) break;
+					e.source = i;
+					EdgeId begin_k = csr_offset[i], end_k = csr_offset[i + 1];
+					for (EdgeId k = begin_k; k < end_k; k++) {
+						e.target = csr_neighbors[k];
+						if (csr_weights != nullptr && (Properties & PROPERTY_WEIGHT)) e.weight = csr_weights[k];
+						local_value += process(e);
+					}
+					local_read_bytes += (end_k - begin_k) * edge_unit;
+					i++;
+				}
+				write_add(&value, local_value);
+				write_add(&read_bytes, local_read_bytes); });
+			if (update_mode == 1)
+				post_source_window(std::make_pair(begin_vid, end_vid));
+		}
+		BufferManager::global().balance();
+		last_read_bytes = read_bytes;
+		last_skipped_bytes = 0;
+		return value;
+	}
+
+	// 上一次stream_edges实际读的字节数，以及因为区间里没有活跃source而跳过的字节数
+	long streamed_bytes()
+	{
+		return last_read_bytes;
+	}
+
+	long skipped_bytes()
+	{
+		return last_skipped_bytes;
+	}
+
+	// preprocess生成的block (i, j)的统计信息，旧的grid没有时返回nullptr
+	const BlockStats *get_block_stats(int i, int j)
+	{
+		return block_stats == nullptr ? nullptr : &block_stats[(long)i * partitions + j];
+	}
+
+	/**
+	 * @brief 估计以bitmap为frontier调用stream_edges时要读的边字节数：只算source partition有活跃点、
+	 * 并且block_stats里source范围和frontier有交集的block。没有block_stats时按partition估计。
+	 */
+	long estimate_streamed_bytes(Bitmap *bitmap = nullptr)
+	{
+		if (bitmap != nullptr && block_stats != nullptr)
+		{
+			count_active_words(bitmap);
+		}
+		long bytes = 0;
+		for (int i = 0; i < partitions; i++)
+		{
+			VertexId begin_vid, end_vid;
+			std::tie(begin_vid, end_vid) = partition_map.range(i);
+			if (bitmap != nullptr && block_stats == nullptr)
+			{
+				bool active = false;
+				for (VertexId v = begin_vid; v < end_vid && !active; v = (WORD_OFFSET(v) + 1) << 6)
+				{
+					active = bitmap->data[WORD_OFFSET(v)] != 0;
+				}
+				if (!active)
+					continue;
+			}
+			for (int j = 0; j < partitions; j++)
+			{
+				if (bitmap != nullptr && block_stats != nullptr)
+				{
+					const BlockStats &block = block_stats[(long)i * partitions + j];
+					if (block.min_source > block.max_source ||
+						active_words[WORD_OFFSET(block.max_source) + 1] - active_words[WORD_OFFSET(block.min_source)] == 0)
+						continue;
+				}
+				bytes += row_stream_offset[i * partitions + j + 1] - row_stream_offset[i * partitions + j];
+			}
+		}
+		return bytes;
+	}
+
+	// active_words[w]是bitmap里前w个word中非零word的个数，用来O(1)判断一个source范围里有没有活跃的点
+	void count_active_words(Bitmap *bitmap)
+	{
+		long words = WORD_OFFSET(vertices) + 1;
+		if (active_words == nullptr)
+		{
+			active_words = new long[words + 1];
+		}
+		int chunks = parallelism * 4;
+		std::vector<long> chunk_counts(chunks + 1, 0);
+		parallel_for(0, chunks, [&](int chunk)
+					 {
+			size_t begin_w, end_w;
+			std::tie(begin_w, end_w) = get_partition_range(words, chunks, chunk);
+			long count = 0;
+			for (size_t w = begin_w; w < end_w; w++) {
+				count += (bitmap->data[w] != 0);
+			}
+			chunk_counts[chunk + 1] = count; });
+		for (int chunk = 0; chunk < chunks; chunk++)
+		{
+			chunk_counts[chunk + 1] += chunk_counts[chunk];
+		}
+		active_words[0] = 0;
+		parallel_for(0, chunks, [&](int chunk)
+					 {
+			size_t begin_w, end_w;
+			std::tie(begin_w, end_w) = get_partition_range(words, chunks, chunk);
+			long count = chunk_counts[chunk];
+			for (size_t w = begin_w; w < end_w; w++) {
+				count += (bitmap->data[w] != 0);
+				active_words[w + 1] = count;
+			} });
+	}
+
+	// 在线程池上做schedule(dynamic)式的并行for，每个worker每次领一个下标
+	template <typename F>
+	void parallel_for(int begin, int end, F f)
+	{
+		std::atomic<int> next(begin);
+		pool->run([&](int thread_id)
+				  {
+			for (int i = next++; i < end; i = next++) {
+				f(i);
+			} });
 	}
 
 	Bitmap *alloc_bitmap()
@@ -172,59 +821,94 @@ public:
 	 * @param pre batch逻辑的pre钩子function，一次batch开始前会调用。
 	 * @param post batch逻辑的post钩子function，一次batch结束后会调用。
 	 * @return T
+	 *
+	 * process/pre/post是模板参数，直接传lambda时每个vertex的调用可以被内联；传std::function时走下面的包装。
 	 */
-	template <typename T>
-	T stream_vertices(std::function<T(VertexId)> process, Bitmap *bitmap = nullptr, T zero = 0,
-					  std::function<void(std::pair<VertexId, VertexId>)> pre = f_none_1,
-					  std::function<void(std::pair<VertexId, VertexId>)> post = f_none_1)
+	template <typename T, typename Process, typename Pre = VidRangeHook, typename Post = VidRangeHook>
+	T stream_vertices(Process process, Bitmap *bitmap = nullptr, T zero = 0,
+					  Pre pre = f_none_1<VertexId>,
+					  Post post = f_none_1<VertexId>)
 	{
 		T value = zero;
 		//在未使用bitmap并且vertex的大小大于配置的内存的80%时会启用batch方式遍历，这种遍历方式才会调用pre和post函数。用于标记batch的pre和post钩子。
 		if (bitmap == nullptr && vertex_data_bytes > (0.8 * memory_bytes))
 		{
-			for (int cur_partition = 0; cur_partition < partitions; cur_partition += partition_batch)
+			// 预取时同时有三个窗口在内存里（写回中的上一个、正在算的、预读中的下一个），窗口相应缩小
+			// 只有分页的BigVector能交错load/save，没有BufferManager时不预取
+			bool prefetch = prefetch_vertices && BufferManager::global().enabled();
+			int batch = prefetch ? std::max(1, partition_batch / 3) : partition_batch;
+			std::vector<std::pair<int, std::pair<VertexId, VertexId>>> windows;
+			for (int cur_partition = 0; cur_partition < partitions; cur_partition += batch)
 			{
 				VertexId begin_vid, end_vid;
-				begin_vid = get_partition_range(vertices, partitions, cur_partition).first;
-				if (cur_partition + partition_batch >= partitions)
+				begin_vid = partition_map.range(cur_partition).first;
+				if (cur_partition + batch >= partitions)
 				{
 					end_vid = vertices;
 				}
 				else
 				{
-					end_vid = get_partition_range(vertices, partitions, cur_partition + partition_batch).first;
+					end_vid = partition_map.range(cur_partition + batch).first;
 				}
-				//这里通过一些逻辑得到一个parttition的开始和结束的vertex id，然后传给pre
-				pre(std::make_pair(begin_vid, end_vid));
-#pragma omp parallel for schedule(dynamic) num_threads(parallelism)
-				for (int partition_id = cur_partition; partition_id < cur_partition + partition_batch; partition_id++)
+				windows.push_back(std::make_pair(cur_partition, std::make_pair(begin_vid, end_vid)));
+			}
+			auto process_window = [&](int cur_partition)
+			{
+				parallel_for(cur_partition, cur_partition + batch, [&](int partition_id)
 				{
 					if (partition_id < partitions)
 					{
 						T local_value = zero;
 						VertexId begin_vid, end_vid;
-						std::tie(begin_vid, end_vid) = get_partition_range(vertices, partitions, partition_id);
-						//利用omp的多线程并发，遍历每一个partition里的vertex，并作为入参传给函数process
+						std::tie(begin_vid, end_vid) = partition_map.range(partition_id);
+						//利用线程池的多线程并发，遍历每一个partition里的vertex，并作为入参传给函数process
 						for (VertexId i = begin_vid; i < end_vid; i++)
 						{
 							local_value += process(i);
 						}
-						//用cas的方式执行value+=local_value，因为当前在做omp parallel，不能直接加。
+						//用cas的方式执行value+=local_value，因为当前在多线程并发，不能直接加。
 						write_add(&value, local_value);
 					}
+				});
+			};
+			if (prefetch)
+			{
+				// 算第k个窗口的同时，另一个线程先post第k-1个窗口（写回），再pre第k+1个窗口（预读）；这期间BufferManager不换页
+				pre(windows[0].second);
+				for (size_t k = 0; k < windows.size(); k++)
+				{
+					BufferManager::global().hold();
+					std::thread io_thread([&]()
+										  {
+						if (k > 0)
+							post(windows[k - 1].second);
+						if (k + 1 < windows.size())
+							pre(windows[k + 1].second); });
+					process_window(windows[k].first);
+					io_thread.join();
+					BufferManager::global().release();
+					BufferManager::global().balance();
+				}
+				post(windows.back().second);
+			}
+			else
+			{
+				for (auto &window : windows)
+				{
+					//这里通过一些逻辑得到一个parttition的开始和结束的vertex id，然后传给pre
+					pre(window.second);
+					process_window(window.first);
+					post(window.second);
 				}
-#pragma omp barrier
-				post(std::make_pair(begin_vid, end_vid));
 			}
 		}
 		else
 		{ //这个else唯一的差异在于，
-#pragma omp parallel for schedule(dynamic) num_threads(parallelism)
-			for (int partition_id = 0; partition_id < partitions; partition_id++)
+			parallel_for(0, partitions, [&](int partition_id)
 			{
 				T local_value = zero;
 				VertexId begin_vid, end_vid;
-				std::tie(begin_vid, end_vid) = get_partition_range(vertices, partitions, partition_id);
+				std::tie(begin_vid, end_vid) = partition_map.range(partition_id);
 				if (bitmap == nullptr)
 				{
 					for (VertexId i = begin_vid; i < end_vid; i++)
@@ -261,9 +945,9 @@ public:
 					}
 				}
 				write_add(&value, local_value);
-			}
-#pragma omp barrier
+			});
 		}
+		BufferManager::global().balance();
 		return value;
 	}
 
@@ -297,13 +981,171 @@ public:
 		set_partition_batch(bytes);
 	}
 
+	// 把整个边文件只读映射进来。MAP_NORESERVE：比内存加交换区还大的grid也能映射（不按整个文件预留内存）
+	void *map_edges(int fin)
+	{
+		struct stat s;
+		int status = fstat(fin, &s);
+		if (status != 0)
+		{
+			printf("Value of errno: %d\n", errno);
+			printf("Error state the file: %s\n", strerror(errno));
+			return MAP_FAILED;
+		}
+		size_t size = s.st_size;
+		void *mmap_start = mmap(0, size, PROT_READ, MAP_SHARED | MAP_NORESERVE, fin, 0);
+		if (mmap_start == MAP_FAILED)
+		{
+			printf("mmap failed!\n");
+			printf("Value of errno: %d\n", errno);
+			printf("Error mapping the file: %s\n", strerror(errno));
+			return MAP_FAILED;
+		}
+		madvise(mmap_start, size, MADV_SEQUENTIAL);
+		return mmap_start;
+	}
+
+	/**
+	 * @brief 取得一个task对应的边数据，bytes返回有效字节数（最后一个task按PAGESIZE向上取整，这里截断到文件末尾）。
+	 * mmap模式直接指向映射的页（或拷贝到线程自己的buffer），pread模式读到线程自己的buffer，aio模式下task_start已经是读好的buffer。
+	 */
+	char *fetch_task(int thread_id, int fin, void *task_start, long offset, long length, long file_bytes, long &bytes, int mode)
+	{
+		switch (mode)
+		{
+		case IO_MMAP:
+			bytes = std::min(length, file_bytes - offset);
+			if (zero_copy)
+			{
+				return (char *)task_start + offset;
+			}
+			memcpy(buffer_pool[thread_id], (char *)task_start + offset, bytes);
+			return buffer_pool[thread_id];
+		case IO_PREAD:
+		{
+			// task是精确的边区间，读的时候按PAGESIZE对齐（O_DIRECT需要）
+			long aligned_offset = offset / PAGESIZE * PAGESIZE;
+			long aligned_length = (offset + length - aligned_offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+			pread_full(fin, buffer_pool[thread_id], aligned_length, aligned_offset);
+			bytes = std::min(length, file_bytes - offset);
+			return buffer_pool[thread_id] + (offset - aligned_offset);
+		}
+		case IO_AIO:
+			bytes = length;
+			return (char *)task_start;
+		default:
+			assert(false);
+		}
+		return nullptr;
+	}
+
+	/**
+	 * @brief 对一个task里的每条边调用f。原始格式下从offset之后的第一个边界开始在buffer上遍历
+	 * （边可能在只读映射的页里，逐条拷到局部的Edge再交给f）；压缩格式下task由完整的chunk组成，逐个解码到线程自己的decode_pool里。
+	 */
+	template <typename F>
+	void for_each_edge(int thread_id, char *buffer, long offset, long bytes, const Weight *weights, F f)
+	{
+		if (split_properties)
+		{
+			// weights[k]是task里第k条完整的边的weight，不需要weight时为nullptr
+			Edge e;
+			e.weight = 0;
+			long k = 0;
+			for (long pos = (edge_unit - offset % edge_unit) % edge_unit; pos + edge_unit <= bytes; pos += edge_unit, k++)
+			{
+				e.source = *(VertexId *)(buffer + pos);
+				e.target = *(VertexId *)(buffer + pos + sizeof(VertexId));
+				if (weights != nullptr)
+					e.weight = weights[k];
+				f(e);
+			}
+			return;
+		}
+		if (!compressed)
+		{
+			// first edge boundary at or after offset
+			Edge e;
+			e.weight = 0;
+			for (long pos = (edge_unit - offset % edge_unit) % edge_unit; pos + edge_unit <= bytes; pos += edge_unit)
+			{
+				e.source = *(VertexId *)(buffer + pos);
+				e.target = *(VertexId *)(buffer + pos + sizeof(VertexId));
+				if (edge_type == 1)
+					e.weight = *(Weight *)(buffer + pos + sizeof(VertexId) * 2);
+				f(e);
+			}
+			return;
+		}
+		Edge *edges = decode_pool[thread_id];
+		for (long pos = 0; pos < bytes;)
+		{
+			long chunk_bytes;
+			int n = decode_chunk(buffer + pos, edges, edge_type == 1, chunk_bytes);
+			for (int k = 0; k < n; k++)
+			{
+				f(edges[k]);
+			}
+			pos += chunk_bytes;
+		}
+	}
+
+	/**
+	 * @brief 拆开存放属性时取得一个task里各条边的weight，返回task里第一条完整的边的weight。
+	 * mmap模式直接指向映射的页，pread/aio模式由worker自己pread到property_pool里（按PAGESIZE对齐，O_DIRECT需要）。
+	 */
+	const Weight *fetch_weights(int thread_id, int fin, void *mmap_start, long offset, long bytes, long &read_bytes)
+	{
+		long begin_offset = (offset + edge_unit - 1) / edge_unit * sizeof(Weight);
+		long end_offset = (offset + bytes) / edge_unit * sizeof(Weight);
+		read_bytes += end_offset - begin_offset;
+		if (mmap_start != MAP_FAILED)
+		{
+			return (Weight *)((char *)mmap_start + begin_offset);
+		}
+		long aligned_offset = begin_offset / PAGESIZE * PAGESIZE;
+		long aligned_length = (end_offset - aligned_offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+		pread_full(fin, property_pool[thread_id], aligned_length, aligned_offset);
+		return (Weight *)(property_pool[thread_id] + (begin_offset - aligned_offset));
+	}
+
+	template <typename T>
+	T stream_vertices(std::function<T(VertexId)> process, Bitmap *bitmap = nullptr, T zero = 0,
+					  std::function<void(std::pair<VertexId, VertexId>)> pre = f_none_1<VertexId>,
+					  std::function<void(std::pair<VertexId, VertexId>)> post = f_none_1<VertexId>)
+	{
+		return stream_vertices<T, std::function<T(VertexId)>, std::function<void(std::pair<VertexId, VertexId>)>, std::function<void(std::pair<VertexId, VertexId>)>>(process, bitmap, zero, pre, post);
+	}
+
 	template <typename T>
 	T stream_edges(std::function<T(Edge &)> process, Bitmap *bitmap = nullptr, T zero = 0, int update_mode = 1,
-				   std::function<void(std::pair<VertexId, VertexId> vid_range)> pre_source_window = f_none_1,
-				   std::function<void(std::pair<VertexId, VertexId> vid_range)> post_source_window = f_none_1,
-				   std::function<void(std::pair<VertexId, VertexId> vid_range)> pre_target_window = f_none_1,
-				   std::function<void(std::pair<VertexId, VertexId> vid_range)> post_target_window = f_none_1)
+				   std::function<void(std::pair<VertexId, VertexId> vid_range)> pre_source_window = f_none_1<VertexId>,
+				   std::function<void(std::pair<VertexId, VertexId> vid_range)> post_source_window = f_none_1<VertexId>,
+				   std::function<void(std::pair<VertexId, VertexId> vid_range)> pre_target_window = f_none_1<VertexId>,
+				   std::function<void(std::pair<VertexId, VertexId> vid_range)> post_target_window = f_none_1<VertexId>)
+	{
+		typedef std::function<void(std::pair<VertexId, VertexId>)> Hook;
+		return stream_edges<T, PROPERTY_ALL, std::function<T(Edge &)>, Hook, Hook, Hook, Hook>(process, bitmap, zero, update_mode,
+																			   pre_source_window, post_source_window, pre_target_window, post_target_window);
+	}
+
+	// 同上，process和窗口钩子都是模板参数，每条边上的process调用可以内联，不再经过std::function的间接调用。
+	// Properties是process要用到的属性列（PROPERTY_WEIGHT等），属性拆开存放时只读这些列，比如BFS传PROPERTY_NONE只读(source, target)
+	template <typename T, int Properties = PROPERTY_ALL, typename Process, typename PreSourceWindow = VidRangeHook, typename PostSourceWindow = VidRangeHook,
+			  typename PreTargetWindow = VidRangeHook, typename PostTargetWindow = VidRangeHook>
+	T stream_edges(Process process, Bitmap *bitmap = nullptr, T zero = 0, int update_mode = 1,
+				   PreSourceWindow pre_source_window = f_none_1<VertexId>,
+				   PostSourceWindow post_source_window = f_none_1<VertexId>,
+				   PreTargetWindow pre_target_window = f_none_1<VertexId>,
+				   PostTargetWindow post_target_window = f_none_1<VertexId>)
 	{
+		// 按column分配任务时不走稀疏模式，稀疏模式按source遍历，保证不了target独占
+		bool exclusive = update_mode == 1 && targets_exclusive();
+		if (bitmap != nullptr && has_sparse_index && sparse_threshold > 0 && !exclusive &&
+			count_active_vertices(bitmap) < sparse_threshold * vertices)
+		{
+			return stream_sparse_edges<T, Properties>(process, bitmap, zero, update_mode, pre_source_window, post_source_window);
+		}
 		if (bitmap == nullptr)
 		{
 			for (int i = 0; i < partitions; i++)
@@ -318,11 +1160,10 @@ public:
 				should_access_shard[i] = false;
 			}
 			//这里用并发的手段确定哪些partition需要访问，哪些不需要，确定的依据是bitmap
-#pragma omp parallel for schedule(dynamic) num_threads(parallelism)
-			for (int partition_id = 0; partition_id < partitions; partition_id++)
+			parallel_for(0, partitions, [&](int partition_id)
 			{
 				VertexId begin_vid, end_vid;
-				std::tie(begin_vid, end_vid) = get_partition_range(vertices, partitions, partition_id);
+				std::tie(begin_vid, end_vid) = partition_map.range(partition_id);
 				VertexId i = begin_vid;
 				while (i < end_vid)
 				{
@@ -335,14 +1176,17 @@ public:
 					}
 					i = (WORD_OFFSET(i) + 1) << 6;
 				}
+			});
+			if (column_summary != nullptr || row_summary != nullptr || block_stats != nullptr)
+			{
+				count_active_words(bitmap);
 			}
-#pragma omp barrier
 		}
 
 		T value = zero;
-		Queue<std::tuple<void *, long, long>> tasks(65536);
-		std::vector<std::thread> threads;
+		RingQueue<std::tuple<void *, long, long>> tasks(65536);
 		long read_bytes = 0;
+		long skipped_bytes = 0;
 
 		long total_bytes = 0;
 		for (int i = 0; i < partitions; i++)
@@ -350,10 +1194,8 @@ public:
 			//不需要访问的partition直接跳过
 			if (!should_access_shard[i])
 				continue;
-			for (int j = 0; j < partitions; j++)
-			{
-				total_bytes += fsize[i][j];
-			}
+			// row里source partition i的block是连续的
+			total_bytes += row_stream_offset[(i + 1) * partitions] - row_stream_offset[i * partitions];
 		}
 		int read_mode;
 		//图比memory_budge大，跳过page cache
@@ -368,64 +1210,241 @@ public:
 			// printf("use buffered I/O\n");
 		}
 
-		int fin;
-		long offset = 0;
-		switch (update_mode)
+		int fin = -1;
+		// 拆开存放属性并且process要用weight时，weight列的文件和映射
+		bool read_weights = split_properties && (Properties & PROPERTY_WEIGHT);
+		int property_fin = -1;
+		void *property_mmap_start = MAP_FAILED;
+		// mmap模式下task里带的是映射的起始地址，pread/aio模式下带的是buffer
+		void *mmap_start = MAP_FAILED;
+		long file_bytes = 0;
+		// aio模式下buffer_pool里的buffer在提交I/O的主线程和worker之间流转，aio_tasks记下每个buffer对应的精确边区间
+		RingQueue<char *> free_buffers(buffer_pool_size);
+		std::unordered_map<char *, std::pair<long, long>> aio_tasks;
+		if (io_mode == IO_AIO)
 		{
-		case 0: // source oriented update
+			for (int i = 0; i < buffer_pool_size; i++)
+			{
+				free_buffers.push(buffer_pool[i]);
+			}
+		}
+		auto on_read = [&](char *buffer, long offset, long length, long result)
 		{
-			threads.clear();
-			for (int ti = 0; ti < parallelism; ti++)
+			if (result < 0)
 			{
-				threads.emplace_back([&](int thread_id)
-									 {
-												T local_value = zero;
-												long local_read_bytes = 0;
-												while (true) {
-						void* mmap_start;
-						long offset, length;
-						std::tie(mmap_start, offset, length) = tasks.pop();
-						if (mmap_start==MAP_FAILED) break;
-						char * buffer = buffer_pool[thread_id];
-						//long bytes = pread(mmap_start, buffer, length, offset);
-						long bytes = length;
-						memcpy(buffer, mmap_start+offset, length);
-						//assert(bytes>0);
-						local_read_bytes += bytes;
-						// CHECK: start position should be offset % edge_unit
-						for (long pos=offset % edge_unit;pos+edge_unit<=bytes;pos+=edge_unit) {
-							Edge & e = *(Edge*)(buffer+pos);
-							if (bitmap==nullptr || bitmap->get_bit(e.source)) {
-								local_value += process(e);
-							}
-						}
+				fprintf(stderr, "aio read failed: %s\n", strerror(-result));
+				exit(-1);
+			}
+			long task_offset, task_length;
+			std::tie(task_offset, task_length) = aio_tasks[buffer];
+			long bytes = std::min(task_offset + task_length, file_bytes) - offset;
+			if (result < bytes)
+			{
+				pread_full(fin, buffer + result, length - result, offset + result);
+			}
+			tasks.push(std::make_tuple((void *)(buffer + (task_offset - offset)), task_offset, std::min(task_length, file_bytes - task_offset)));
+		};
+		// task是精确的边区间[offset, offset + length)，相邻block共享的页在pread/aio模式下会读两次，但每条边只处理一次
+		// 非空时task不进队列，先收集起来（按column分配任务时用）
+		std::vector<std::pair<long, long>> *collected_tasks = nullptr;
+		auto push_task = [&](long offset, long length)
+		{
+			if (collected_tasks != nullptr)
+			{
+				collected_tasks->push_back(std::make_pair(offset, length));
+				return;
+			}
+			if (io_mode == IO_AIO)
+			{
+				reader->reap(0, on_read);
+				char *buffer = free_buffers.pop();
+				if (reader->full())
+					reader->reap(1, on_read);
+				long aligned_offset = offset / PAGESIZE * PAGESIZE;
+				aio_tasks[buffer] = std::make_pair(offset, length);
+				reader->submit(fin, buffer, (offset + length - aligned_offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE, aligned_offset);
+			}
+			else
+			{
+				// MAP_FAILED is the stop signal, pread tasks carry no address
+				tasks.push(std::make_tuple(io_mode == IO_MMAP ? mmap_start : nullptr, offset, length));
+			}
+		};
+		// 当前文件的区间summary，以及当前窗口的source范围[window_begin, window_end)
+		VertexId *summary = nullptr;
+		// 压缩格式下当前文件的chunk起点，task只能在chunk边界上切开
+		long *chunk_offset = nullptr;
+		long chunks = 0;
+		VertexId window_begin = 0, window_end = vertices;
+		auto region_active = [&](long region)
+		{
+			VertexId lo = std::max(summary[region * 2], window_begin);
+			VertexId hi = std::min(summary[region * 2 + 1], window_end - 1);
+			if (lo > hi)
+				return false;
+			if (bitmap == nullptr)
+				return true;
+			return active_words[WORD_OFFSET(hi) + 1] - active_words[WORD_OFFSET(lo)] > 0;
+		};
+		// 对齐后的读取不能超过一个IOSIZE的buffer
+		const long task_size = IOSIZE - 2 * PAGESIZE;
+		// 把[offset, stop)切成task，跳过没有活跃source的SUMMARYSIZE区间
+		auto push_range = [&](long offset, long stop)
+		{
+			if (chunk_offset != nullptr)
+			{
+				// block的起点总是chunk的起点，每个task至少一个chunk
+				long c = std::lower_bound(chunk_offset, chunk_offset + chunks + 1, offset) - chunk_offset;
+				assert(chunk_offset[c] == offset);
+				while (offset < stop)
+				{
+					long task_end = chunk_offset[++c];
+					while (task_end < stop && chunk_offset[c + 1] - offset <= task_size)
+					{
+						task_end = chunk_offset[++c];
 					}
-					write_add(&value, local_value);
-					write_add(&read_bytes, local_read_bytes); },
-									 ti);
+					push_task(offset, task_end - offset);
+					offset = task_end;
+				}
+				return;
 			}
-			fin = open((path + "/row").c_str(), read_mode);
-			void *mmap_start = MAP_FAILED;
-			if (fin != -1)
+			while (offset < stop)
 			{
-				struct stat s;
-				int status = fstat(fin, &s);
-				if (status != 0)
+				if (summary == nullptr)
 				{
-					printf("Value of errno: %d\n", errno);
-					printf("Error state the file: %s\n", strerror(errno));
-					return -1;
+					long length = std::min(task_size, stop - offset);
+					push_task(offset, length);
+					offset += length;
+					continue;
 				}
-				size_t size = s.st_size;
-				mmap_start = mmap(0, size, PROT_READ, MAP_PRIVATE, fin, 0);
-				if (mmap_start == MAP_FAILED)
+				long task_end = std::min((offset / SUMMARYSIZE + 1) * SUMMARYSIZE, stop);
+				if (!region_active(offset / SUMMARYSIZE))
 				{
-					printf("mmap failed!\n");
-					printf("Value of errno: %d\n", errno);
-					printf("Error mapping the file: %s\n", strerror(errno));
+					skipped_bytes += task_end - offset;
+					offset = task_end;
+					continue;
+				}
+				while (task_end < stop && task_end - offset < task_size && region_active(task_end / SUMMARYSIZE))
+				{
+					task_end = std::min(std::min(task_end + SUMMARYSIZE, stop), offset + task_size);
+				}
+				push_task(offset, task_end - offset);
+				offset = task_end;
+			}
+		};
+		// block_stats里block (i, j)的source范围和当前窗口、frontier没有交集时整个block跳过
+		auto block_active = [&](int i, int j)
+		{
+			if (block_stats == nullptr)
+				return true;
+			const BlockStats &block = block_stats[(long)i * partitions + j];
+			VertexId lo = std::max(block.min_source, window_begin);
+			VertexId hi = std::min(block.max_source, window_end - 1);
+			if (lo > hi)
+				return false;
+			if (bitmap == nullptr)
+				return true;
+			return active_words[WORD_OFFSET(hi) + 1] - active_words[WORD_OFFSET(lo)] > 0;
+		};
+		// 要读的block先合并成连续的区间，再按大小从大到小切成task，大的区间先开始，窗口末尾不会只剩一个大区间在跑
+		std::vector<std::pair<long, long>> runs;
+		auto add_block = [&](int i, int j, long begin_offset, long end_offset)
+		{
+			if (end_offset <= begin_offset)
+				return;
+			if (!block_active(i, j))
+			{
+				skipped_bytes += end_offset - begin_offset;
+				return;
+			}
+			if (!runs.empty() && runs.back().second == begin_offset)
+				runs.back().second = end_offset;
+			else
+				runs.push_back(std::make_pair(begin_offset, end_offset));
+		};
+		auto push_runs = [&]()
+		{
+			std::stable_sort(runs.begin(), runs.end(), [](const std::pair<long, long> &a, const std::pair<long, long> &b)
+							 { return a.second - a.first > b.second - b.first; });
+			for (auto &run : runs)
+			{
+				push_range(run.first, run.second);
+			}
+			runs.clear();
+		};
+		// aio的buffer是稀缺资源，不批量取
+		size_t task_batch = (io_mode == IO_AIO) ? 1 : TASKBATCH;
+		auto drain_tasks = [&]()
+		{
+			if (io_mode == IO_AIO)
+			{
+				while (reader->pending() > 0)
+					reader->reap(1, on_read);
+			}
+			for (int i = 0; i < parallelism; i++)
+			{
+				tasks.push(std::make_tuple(MAP_FAILED, 0, 0));
+			}
+			pool->wait();
+		};
+		switch (update_mode)
+		{
+		case 0: // source oriented update
+		{
+			file_bytes = row_stream_offset[partitions * partitions];
+			summary = row_summary;
+			chunk_offset = row_chunk_offset;
+			chunks = row_chunks;
+			fin = open((path + (compressed ? "/row_compressed" : "/row")).c_str(), read_mode);
+			if (fin != -1 && io_mode == IO_MMAP)
+			{
+				mmap_start = map_edges(fin);
+				if (mmap_start == MAP_FAILED)
 					return -1;
+			}
+			if (read_weights)
+			{
+				property_fin = open((path + "/row_property_0").c_str(), read_mode);
+				assert(property_fin != -1);
+				if (io_mode == IO_MMAP)
+				{
+					property_mmap_start = map_edges(property_fin);
+					if (property_mmap_start == MAP_FAILED)
+						return -1;
 				}
 			}
+			pool->start([&](int thread_id)
+						{
+												T local_value = zero;
+												long local_read_bytes = 0;
+												std::tuple<void *, long, long> batch[TASKBATCH];
+												bool done = false;
+												while (!done) {
+						size_t n = tasks.pop_batch(batch, task_batch);
+						for (size_t k=0;k<n;k++) {
+							void* task_start;
+							long offset, length;
+							std::tie(task_start, offset, length) = batch[k];
+							if (task_start==MAP_FAILED) {
+								// anything after a stop signal is another worker's stop signal
+								for (k++;k<n;k++) tasks.push(batch[k]);
+								done = true;
+								break;
+							}
+							long bytes;
+							char * buffer = fetch_task(thread_id, fin, task_start, offset, length, file_bytes, bytes, io_mode);
+							local_read_bytes += bytes;
+							const Weight * weights = read_weights ? fetch_weights(thread_id, property_fin, property_mmap_start, offset, bytes, local_read_bytes) : nullptr;
+							for_each_edge(thread_id, buffer, offset, bytes, weights, [&](Edge & e) {
+								if (bitmap==nullptr || bitmap->get_bit(e.source)) {
+									local_value += process(e);
+								}
+							});
+							if (io_mode==IO_AIO) free_buffers.push(buffer - offset % PAGESIZE);
+						}
+					}
+					write_add(&value, local_value);
+					write_add(&read_bytes, local_read_bytes); });
 
 			for (int i = 0; i < partitions; i++)
 			{
@@ -433,163 +1452,185 @@ public:
 					continue;
 				for (int j = 0; j < partitions; j++)
 				{
-					long begin_offset = row_offset[i * partitions + j];
-					if (begin_offset - offset >= PAGESIZE)
-					{
-						offset = begin_offset / PAGESIZE * PAGESIZE;
-					}
-					long end_offset = row_offset[i * partitions + j + 1];
-					if (end_offset <= offset)
-						continue;
-					while (end_offset - offset >= IOSIZE)
-					{
-						tasks.push(std::make_tuple(mmap_start, offset, IOSIZE));
-						offset += IOSIZE;
-					}
-					if (end_offset > offset)
-					{
-						tasks.push(std::make_tuple(mmap_start, offset, (end_offset - offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE));
-						offset += (end_offset - offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
-					}
+					add_block(i, j, row_stream_offset[i * partitions + j], row_stream_offset[i * partitions + j + 1]);
 				}
 			}
-			for (int i = 0; i < parallelism; i++)
+			push_runs();
+			drain_tasks();
+			if (mmap_start != MAP_FAILED)
 			{
-				tasks.push(std::make_tuple(MAP_FAILED, 0, 0));
+				munmap(mmap_start, file_bytes);
 			}
-			for (int i = 0; i < parallelism; i++)
+			if (property_mmap_start != MAP_FAILED)
 			{
-				threads[i].join();
+				munmap(property_mmap_start, file_bytes / edge_unit * sizeof(Weight));
 			}
 		}
 		break;
 			//这个1是默认模式，也是bfs使用的模式
 		case 1: // target oriented update
 		{
-			if (column_mmap_start == MAP_FAILED)
+			file_bytes = column_stream_offset[partitions * partitions];
+			summary = column_summary;
+			chunk_offset = column_chunk_offset;
+			chunks = column_chunks;
+			if (io_mode == IO_MMAP)
 			{
-				fin = open((path + "/column").c_str(), read_mode);
-				// posix_fadvise(fin, 0, 0, POSIX_FADV_SEQUENTIAL);
-				if (fin != -1)
+				if (column_mmap_start == MAP_FAILED)
 				{
-					struct stat s;
-					int status = fstat(fin, &s);
-					if (status != 0)
+					fin = open((path + (compressed ? "/column_compressed" : "/column")).c_str(), read_mode);
+					// posix_fadvise(fin, 0, 0, POSIX_FADV_SEQUENTIAL);
+					if (fin != -1)
 					{
-						printf("Value of errno: %d\n", errno);
-						printf("Error state the file: %s\n", strerror(errno));
-						return -1;
+						//这是我们用mmap的方式改造了他原生的代码。
+						column_mmap_start = map_edges(fin);
+						if (column_mmap_start == MAP_FAILED)
+							return -1;
 					}
-					size_t size = s.st_size;
-					//这是我们用mmap的方式改造了他原生的代码。
-					column_mmap_start = mmap(0, size, PROT_READ, MAP_PRIVATE, fin, 0);
-					if (column_mmap_start == MAP_FAILED)
+				}
+				mmap_start = column_mmap_start;
+			}
+			else
+			{
+				fin = open((path + (compressed ? "/column_compressed" : "/column")).c_str(), read_mode);
+			}
+			if (read_weights)
+			{
+				property_fin = open((path + "/column_property_0").c_str(), read_mode);
+				assert(property_fin != -1);
+				if (io_mode == IO_MMAP)
+				{
+					if (column_property_mmap_start == MAP_FAILED)
 					{
-						printf("mmap failed!\n");
-						printf("Value of errno: %d\n", errno);
-						printf("Error mapping the file: %s\n", strerror(errno));
-						return -1;
+						column_property_mmap_start = map_edges(property_fin);
+						if (column_property_mmap_start == MAP_FAILED)
+							return -1;
 					}
+					property_mmap_start = column_property_mmap_start;
 				}
 			}
 			//以batch的方式遍历partitions
 			for (int cur_partition = 0; cur_partition < partitions; cur_partition += partition_batch)
 			{
 				VertexId begin_vid, end_vid;
-				begin_vid = get_partition_range(vertices, partitions, cur_partition).first;
+				begin_vid = partition_map.range(cur_partition).first;
 				if (cur_partition + partition_batch >= partitions)
 				{
 					end_vid = vertices;
 				}
 				else
 				{
-					end_vid = get_partition_range(vertices, partitions, cur_partition + partition_batch).first;
+					end_vid = partition_map.range(cur_partition + partition_batch).first;
 				}
+				window_begin = begin_vid;
+				window_end = end_vid;
 				//钩子，bfs没用到。
 				pre_source_window(std::make_pair(begin_vid, end_vid));
 				// printf("pre %d %d\n", begin_vid, end_vid);
-				threads.clear();
-				for (int ti = 0; ti < parallelism; ti++)
+				// 处理一个task里source在当前窗口内的边
+				auto run_task = [&](int thread_id, void *task_start, long offset, long length, int mode, T &local_value, long &local_read_bytes)
+				{
+					long bytes;
+					char *buffer = fetch_task(thread_id, fin, task_start, offset, length, file_bytes, bytes, mode);
+					local_read_bytes += bytes;
+					const Weight *weights = read_weights ? fetch_weights(thread_id, property_fin, property_mmap_start, offset, bytes, local_read_bytes) : nullptr;
+					for_each_edge(thread_id, buffer, offset, bytes, weights, [&](Edge &e)
+								  {
+						if (e.source < begin_vid || e.source >= end_vid) {
+							return;
+						}
+						//bitmap如果没给，肯定要处理，或者bitmap里标注了这个点需要处理，则也是调用process
+						if (bitmap==nullptr || bitmap->get_bit(e.source)) {
+							local_value += process(e);
+						} });
+					if (mode == IO_AIO)
+						free_buffers.push(buffer - offset % PAGESIZE);
+				};
+				if (exclusive)
 				{
-					//初始化n个线程
-					threads.emplace_back([&](int thread_id)
-										 {
+					// 每个column的task单独收集，worker每次领一整个column，先领大的
+					std::vector<std::vector<std::pair<long, long>>> column_tasks(partitions);
+					std::vector<std::pair<long, int>> columns;
+					for (int j = 0; j < partitions; j++)
+					{
+						collected_tasks = &column_tasks[j];
+						for (int i = cur_partition; i < cur_partition + partition_batch && i < partitions; i++)
+						{
+							if (!should_access_shard[i])
+								continue;
+							add_block(i, j, column_stream_offset[j * partitions + i], column_stream_offset[j * partitions + i + 1]);
+						}
+						push_runs();
+						long column_bytes = 0;
+						for (auto &task : column_tasks[j])
+						{
+							column_bytes += task.second;
+						}
+						if (column_bytes > 0)
+							columns.push_back(std::make_pair(column_bytes, j));
+					}
+					collected_tasks = nullptr;
+					std::sort(columns.begin(), columns.end(), [](const std::pair<long, int> &a, const std::pair<long, int> &b)
+							  { return a.first > b.first; });
+					// worker自己同步读task，aio退化为pread
+					int mode = (io_mode == IO_AIO) ? IO_PREAD : io_mode;
+					std::atomic<size_t> next_column(0);
+					pool->run([&](int thread_id)
+							  {
 						T local_value = zero;
 						long local_read_bytes = 0;
-						while (true) {
-							//int fin;
-							void* mmap_start;
-							long offset, length;
-							//每个线程从tasks里取出连续内存空间的起始地址，offset和长度
-							std::tie(mmap_start, offset, length) = tasks.pop();
-							if (mmap_start==MAP_FAILED) break;
-							//每个线程有一个自己的buffer
-							char * buffer = buffer_pool[thread_id];
-							//long bytes = pread(mmap_start, buffer, length, offset);
-							long bytes = length;
-							//从文件读取相应长度的内容到线程自己的buffer里。
-							memcpy(buffer, mmap_start+offset, length);
-							//assert(bytes>0);
-							local_read_bytes += bytes;
-							// CHECK: start position should be offset % edge_unit
-							for (long pos=offset % edge_unit;pos+edge_unit<=bytes;pos+=edge_unit) {
-								//因为我们文件里组织的边列表是二进制格式的，所以只要拿到对应的地址就可以直接构造一个Edge结构出来了
-								Edge & e = *(Edge*)(buffer+pos);
-								if (e.source < begin_vid || e.source >= end_vid) {
-									continue;
-								}
-								//bitmap如果没给，肯定要处理，或者bitmap里标注了这个点需要处理，则也是调用process
-								if (bitmap==nullptr || bitmap->get_bit(e.source)) {
-									local_value += process(e);
-								}
+						for (size_t c = next_column++; c < columns.size(); c = next_column++) {
+							for (auto & task : column_tasks[columns[c].second]) {
+								run_task(thread_id, mode == IO_MMAP ? mmap_start : nullptr, task.first, task.second, mode, local_value, local_read_bytes);
 							}
 						}
-						//最后把运行相关结果累加起来
 						write_add(&value, local_value);
-						write_add(&read_bytes, local_read_bytes); },
-										 ti);
+						write_add(&read_bytes, local_read_bytes); });
 				}
-				offset = 0;
-				// TODO:这里的逻辑没有细看，不过大致意思就是根据各个offset划分出对应的文件区段，然后推入到tasks这个Queue的实例里，让上面的线程从里面取出来读取文件内容。
-				for (int j = 0; j < partitions; j++)
+				else
 				{
-					for (int i = cur_partition; i < cur_partition + partition_batch; i++)
-					{
-						if (i >= partitions)
-							break;
-						if (!should_access_shard[i])
-							continue;
-						// column_offset是一个long *类型，本质就是一个数组。从这里推测，是获取一个partition的column在一个Grid里的begin_offset和end_offset
-						// TODO:有时间研究下它的细节，没有就先推进
-						long begin_offset = column_offset[j * partitions + i];
-						if (begin_offset - offset >= PAGESIZE)
-						{
-							offset = begin_offset / PAGESIZE * PAGESIZE;
-						}
-						long end_offset = column_offset[j * partitions + i + 1];
-						if (end_offset <= offset)
-							continue;
-						//顺着这个column遍历整个partition。
-						while (end_offset - offset >= IOSIZE)
-						{
-							tasks.push(std::make_tuple(column_mmap_start, offset, IOSIZE));
-							offset += IOSIZE;
+					//唤醒线程池里的n个worker
+					pool->start([&](int thread_id)
+								{
+						T local_value = zero;
+						long local_read_bytes = 0;
+						std::tuple<void *, long, long> batch[TASKBATCH];
+						bool done = false;
+						while (!done) {
+							//每个线程从tasks里批量取出连续内存空间的起始地址，offset和长度
+							size_t n = tasks.pop_batch(batch, task_batch);
+							for (size_t k=0;k<n;k++) {
+								void* task_start;
+								long offset, length;
+								std::tie(task_start, offset, length) = batch[k];
+								if (task_start==MAP_FAILED) {
+									// anything after a stop signal is another worker's stop signal
+									for (k++;k<n;k++) tasks.push(batch[k]);
+									done = true;
+									break;
+								}
+								run_task(thread_id, task_start, offset, length, io_mode, local_value, local_read_bytes);
+							}
 						}
-						if (end_offset > offset)
+						//最后把运行相关结果累加起来
+						write_add(&value, local_value);
+						write_add(&read_bytes, local_read_bytes); });
+					// column里target partition j的一段里，当前窗口的source partition对应的block (i, j)是连续的
+					for (int j = 0; j < partitions; j++)
+					{
+						for (int i = cur_partition; i < cur_partition + partition_batch; i++)
 						{
-							tasks.push(std::make_tuple(column_mmap_start, offset, (end_offset - offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE));
-							offset += (end_offset - offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+							if (i >= partitions)
+								break;
+							if (!should_access_shard[i])
+								continue;
+							add_block(i, j, column_stream_offset[j * partitions + i], column_stream_offset[j * partitions + i + 1]);
 						}
 					}
+					push_runs();
+					drain_tasks();
 				}
-				for (int i = 0; i < parallelism; i++)
-				{
-					tasks.push(std::make_tuple(MAP_FAILED, 0, 0));
-				}
-				for (int i = 0; i < parallelism; i++)
-				{
-					threads[i].join();
-				}
+				BufferManager::global().balance();
 				post_source_window(std::make_pair(begin_vid, end_vid));
 				// printf("post %d %d\n", begin_vid, end_vid);
 			}
@@ -599,10 +1640,19 @@ public:
 			assert(false);
 		}
 
-		close(fin);
-		// printf("streamed %ld bytes of edges\n", read_bytes);
+		if (fin != -1)
+			close(fin);
+		if (property_fin != -1)
+			close(property_fin);
+		// worker都停了，把这一遍里按需读进来、超出budget的点数据页换出去
+		BufferManager::global().balance();
+		last_read_bytes = read_bytes;
+		last_skipped_bytes = skipped_bytes;
+		// printf("streamed %ld bytes of edges, skipped %ld\n", read_bytes, skipped_bytes);
 		return value;
 	}
 };
 
+typedef GraphT<VertexId> Graph;
+
 #endif
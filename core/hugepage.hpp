@@ -0,0 +1,201 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "core/constants.hpp"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+/**
+ * @brief 点数据、bitmap和I/O buffer这些大块匿名内存的分配。GRIDGRAPH_HUGEPAGES=off|thp|2m|1g选择想要的页：
+ * thp（默认）用透明大页（对齐到2MB再MADV_HUGEPAGE），2m/1g用hugetlbfs的大页。要的页拿不到时依次退到更小的页，
+ * 实际用的页记在huge_page_bytes()里；显式设置了GRIDGRAPH_HUGEPAGES时每类内存第一次分配会在stderr上报告。
+ */
+inline int huge_page_policy() {
+	static int policy = []() {
+		const char * env = getenv("GRIDGRAPH_HUGEPAGES");
+		if (env == NULL || strcmp(env, "thp") == 0) return PAGES_THP;
+		if (strcmp(env, "off") == 0) return PAGES_SMALL;
+		if (strcmp(env, "2m") == 0) return PAGES_HUGETLB_2M;
+		if (strcmp(env, "1g") == 0) return PAGES_HUGETLB_1G;
+		fprintf(stderr, "unknown GRIDGRAPH_HUGEPAGES=%s, using thp\n", env);
+		return PAGES_THP;
+	}();
+	return policy;
+}
+
+// 内核的透明大页没有关掉（enabled不是[never]）
+inline bool thp_available() {
+	static bool available = []() {
+		FILE * fin = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+		if (fin == NULL) return false;
+		char line[128] = {0};
+		bool ok = fgets(line, sizeof(line), fin) != NULL && strstr(line, "[never]") == NULL;
+		fclose(fin);
+		return ok;
+	}();
+	return available;
+}
+
+inline long huge_page_size(int backing) {
+	switch (backing) {
+	case PAGES_THP:
+	case PAGES_HUGETLB_2M:
+		return 1l << 21;
+	case PAGES_HUGETLB_1G:
+		return 1l << 30;
+	default:
+		return 4096;
+	}
+}
+
+inline const char * huge_page_name(int backing) {
+	switch (backing) {
+	case PAGES_THP:
+		return "transparent huge";
+	case PAGES_HUGETLB_2M:
+		return "2 MB hugetlb";
+	case PAGES_HUGETLB_1G:
+		return "1 GB hugetlb";
+	default:
+		return "4 KB";
+	}
+}
+
+// 各种页上分配出去的字节数
+inline std::atomic<long> & huge_page_bytes(int backing) {
+	static std::atomic<long> bytes[4];
+	return bytes[backing];
+}
+
+inline long round_up(long bytes, long unit) {
+	return (bytes + unit - 1) / unit * unit;
+}
+
+/**
+ * @brief 分配bytes字节清零的匿名内存，backing返回实际用的页，用huge_free(ptr, bytes, backing)释放。
+ * max_backing限制最大的页（比如按2MB换出的内存不能用1GB页），noreserve时不预留交换空间（hugetlb的页总是预留）。
+ */
+inline void * huge_alloc(long bytes, const char * what, int & backing, int max_backing = PAGES_HUGETLB_1G, bool noreserve = false) {
+	int wanted = std::min(huge_page_policy(), max_backing);
+	// 不到一个大页的分配不值得
+	if (bytes < huge_page_size(PAGES_THP)) wanted = PAGES_SMALL;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | (noreserve ? MAP_NORESERVE : 0);
+	void * ptr = MAP_FAILED;
+	backing = wanted;
+	if (backing == PAGES_HUGETLB_1G) {
+		ptr = mmap(NULL, round_up(bytes, huge_page_size(backing)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+		if (ptr == MAP_FAILED) backing = PAGES_HUGETLB_2M;
+	}
+	if (backing == PAGES_HUGETLB_2M) {
+		ptr = mmap(NULL, round_up(bytes, huge_page_size(backing)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (ptr == MAP_FAILED) backing = PAGES_THP;
+	}
+	if (backing == PAGES_THP) {
+		if (thp_available()) {
+			// 多映射一个大页，截出2MB对齐的一段，大页才能覆盖整个区间
+			long page = huge_page_size(PAGES_THP);
+			long length = round_up(bytes, page);
+			char * raw = (char *)mmap(NULL, length + page, PROT_READ | PROT_WRITE, flags, -1, 0);
+			assert(raw != MAP_FAILED);
+			char * aligned = (char *)round_up((long)(uintptr_t)raw, page);
+			if (aligned > raw) assert(munmap(raw, aligned - raw) == 0);
+			if (raw + page > aligned) assert(munmap(aligned + length, raw + page - aligned) == 0);
+			ptr = aligned;
+			if (madvise(ptr, length, MADV_HUGEPAGE) != 0) {
+				assert(munmap(ptr, length) == 0);
+				ptr = MAP_FAILED;
+				backing = PAGES_SMALL;
+			}
+		} else {
+			backing = PAGES_SMALL;
+		}
+	}
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+		assert(ptr != MAP_FAILED);
+	}
+	huge_page_bytes(backing) += bytes;
+	if (getenv("GRIDGRAPH_HUGEPAGES") != NULL && bytes >= huge_page_size(PAGES_THP)) {
+		static std::mutex mutex;
+		static std::set<std::string> reported;
+		std::unique_lock<std::mutex> lock(mutex);
+		if (reported.insert(what).second) {
+			fprintf(stderr, "%s: %ld MB on %s pages (asked for %s)\n", what, bytes >> 20, huge_page_name(backing), huge_page_name(wanted));
+		}
+	}
+	return ptr;
+}
+
+/**
+ * @brief GRIDGRAPH_NUMA=interleave时把[ptr, ptr+bytes)的页轮流放到各个NUMA节点上，要在第一次访问之前调用。只有一个节点时什么都不做。
+ */
+inline void interleave_memory(void * ptr, long bytes) {
+	const char * env = getenv("GRIDGRAPH_NUMA");
+	if (env == NULL || strcmp(env, "interleave") != 0) return;
+	unsigned long mask = 0;
+	int nodes = 0;
+	char path[64];
+	for (int node=0;node<64;node++) {
+		sprintf(path, "/sys/devices/system/node/node%d", node);
+		if (access(path, F_OK) == 0) {
+			mask |= 1ul << node;
+			nodes++;
+		}
+	}
+	if (nodes < 2) return;
+	if (syscall(SYS_mbind, ptr, round_up(bytes, 4096), MPOL_INTERLEAVE, &mask, 64, 0) != 0) {
+		fprintf(stderr, "mbind(MPOL_INTERLEAVE) failed: %s\n", strerror(errno));
+	}
+}
+
+inline void huge_free(void * ptr, long bytes, int backing) {
+	// 4KB页时huge_alloc按bytes映射，大页时按页对齐映射
+	long length = backing == PAGES_SMALL ? bytes : round_up(bytes, huge_page_size(backing));
+	assert(munmap(ptr, length) == 0);
+	huge_page_bytes(backing) -= bytes;
+}
+
+#endif
@@ -17,6 +17,12 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #ifndef PARTITION_H
 #define PARTITION_H
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "core/type.hpp"
+
 inline size_t get_partition_id(const size_t vertices, const size_t partitions, const size_t vertex_id) {
         if (vertices % partitions==0) {
                 const size_t partition_size = vertices / partitions;
@@ -50,4 +56,58 @@ inline std::pair<size_t, size_t> get_partition_range(const size_t vertices, cons
         return std::make_pair(begin, end);
 }
 
+/**
+ * @brief 一个grid的partition划分。默认按点数均分；preprocess -e会按边数和点数的混合代价切分，
+ * 边界存在partition_offset文件里：partition i = [offset[i], offset[i+1])。
+ * vertex_id到partition先查表定位到相邻的几个partition，再在其中二分。
+ */
+template <typename VID>
+class PartitionMapT {
+	size_t vertices;
+	size_t partitions;
+	std::vector<VID> offset;
+	std::vector<int> lookup;
+	int shift;
+public:
+	PartitionMapT() : vertices(0), partitions(0), shift(0) { }
+	// offset为空指针时按点数均分
+	void init(size_t vertices, size_t partitions, const VID * offset = nullptr) {
+		this->vertices = vertices;
+		this->partitions = partitions;
+		this->offset.clear();
+		lookup.clear();
+		if (offset==nullptr) return;
+		this->offset.assign(offset, offset + partitions + 1);
+		// 表的大小约为partitions的4倍
+		shift = 0;
+		while ((vertices >> shift) > partitions * 4) shift++;
+		lookup.resize((vertices >> shift) + 1);
+		size_t p = 0;
+		for (size_t k=0;k<lookup.size();k++) {
+			size_t v = std::min(k << shift, vertices - 1);
+			while ((size_t)offset[p + 1] <= v) p++;
+			lookup[k] = p;
+		}
+	}
+	bool balanced() const {
+		return !offset.empty();
+	}
+	size_t id(size_t vertex_id) const {
+		if (offset.empty()) {
+			return get_partition_id(vertices, partitions, vertex_id);
+		}
+		size_t k = vertex_id >> shift;
+		size_t lo = lookup[k];
+		size_t hi = (k + 1 < lookup.size()) ? lookup[k + 1] : partitions - 1;
+		return std::upper_bound(offset.begin() + lo + 1, offset.begin() + hi + 1, (VID)vertex_id) - offset.begin() - 1;
+	}
+	std::pair<size_t, size_t> range(size_t partition_id) const {
+		if (offset.empty()) {
+			return get_partition_range(vertices, partitions, partition_id);
+		}
+		return std::make_pair((size_t)offset[partition_id], (size_t)offset[partition_id + 1]);
+	}
+};
+typedef PartitionMapT<VertexId> PartitionMap;
+
 #endif
@@ -20,6 +20,8 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <thread>
 
 template <typename T>
 class Queue {
@@ -54,4 +56,133 @@ public:
 	}
 };
 
+/**
+ * @brief 有界的无锁多生产者/多消费者环形队列（Vyukov）。push/pop先自旋，队列长时间满/空时才在条件变量上睡眠。
+ */
+template <typename T>
+class RingQueue {
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+	static const int SPINS = 256;
+	Cell * cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) std::atomic<size_t> dequeue_pos;
+	alignas(64) std::atomic<int> sleepers;
+	std::mutex mutex;
+	std::condition_variable cond;
+	void wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) > 0) {
+			std::unique_lock<std::mutex> lock(mutex);
+			lock.unlock();
+			cond.notify_all();
+		}
+	}
+	template <typename F>
+	void wait_until(F ready) {
+		for (int i=0;i<SPINS;i++) {
+			if (ready()) return;
+			if (i >= SPINS / 2) std::this_thread::yield();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		sleepers.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!ready()) {
+			cond.wait(lock);
+		}
+		sleepers.fetch_sub(1);
+	}
+public:
+	RingQueue(const size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) size <<= 1;
+		cells = new Cell [size];
+		mask = size - 1;
+		for (size_t i=0;i<size;i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+		sleepers.store(0, std::memory_order_relaxed);
+	}
+	~RingQueue() {
+		delete [] cells;
+	}
+	bool try_push(const T & item) {
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			Cell & cell = cells[pos & mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			long diff = (long)seq - (long)pos;
+			if (diff == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = item;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+	/**
+	 * @brief 一次取出最多max个连续的元素，返回取到的个数，队列为空时返回0。
+	 */
+	size_t try_pop_batch(T * items, size_t max) {
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			size_t n = 0;
+			while (n < max) {
+				size_t seq = cells[(pos + n) & mask].sequence.load(std::memory_order_acquire);
+				if ((long)seq - (long)(pos + n + 1) != 0) break;
+				n++;
+			}
+			if (n == 0) {
+				size_t seq = cells[pos & mask].sequence.load(std::memory_order_acquire);
+				if ((long)seq - (long)(pos + 1) < 0) return 0;
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+				for (size_t i=0;i<n;i++) {
+					Cell & cell = cells[(pos + i) & mask];
+					items[i] = cell.data;
+					cell.sequence.store(pos + i + mask + 1, std::memory_order_release);
+				}
+				return n;
+			}
+		}
+	}
+	bool try_pop(T & item) {
+		return try_pop_batch(&item, 1) == 1;
+	}
+	void push(const T & item) {
+		if (!try_push(item)) {
+			wait_until([&]{ return try_push(item); });
+		}
+		wake();
+	}
+	T pop() {
+		T item;
+		pop_batch(&item, 1);
+		return item;
+	}
+	/**
+	 * @brief 阻塞直到至少取到一个元素，最多取max个。
+	 */
+	size_t pop_batch(T * items, size_t max) {
+		size_t n = try_pop_batch(items, max);
+		if (n == 0) {
+			wait_until([&]{ return (n = try_pop_batch(items, max)) > 0; });
+		}
+		wake();
+		return n;
+	}
+};
+
 #endif
@@ -0,0 +1,163 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "core/partition.hpp"
+
+/**
+ * @brief 常驻的、绑核的工作线程池。start(job)唤醒所有worker执行job(thread_id)，wait()等待它们全部完成。
+ * 唤醒和完成都是先自旋一小段时间再在条件变量上睡眠，BFS这种很多次很短的迭代不再反复创建线程。
+ */
+class ThreadPool {
+	static const int SPINS = 1 << 14;
+	int threads;
+	std::vector<std::thread> workers;
+	std::function<void(int)> job;
+	std::atomic<unsigned long> generation;
+	char padding[64]; // generation和running不在同一个cache line（线程池是new出来的，C++11的new不保证alignas(64)）
+	std::atomic<int> running;
+	std::atomic<bool> stopping;
+	std::mutex mutex;
+	std::condition_variable cond_start;
+	std::condition_variable cond_done;
+
+	static bool & in_pool() {
+		static thread_local bool flag = false;
+		return flag;
+	}
+	void worker_loop(int thread_id) {
+		in_pool() = true;
+		unsigned long seen = 0;
+		while (true) {
+			int spins = 0;
+			while (generation.load(std::memory_order_acquire) == seen && spins < SPINS) {
+				spins++;
+			}
+			if (generation.load(std::memory_order_acquire) == seen) {
+				std::unique_lock<std::mutex> lock(mutex);
+				cond_start.wait(lock, [&]{ return generation.load(std::memory_order_acquire) != seen; });
+			}
+			seen = generation.load(std::memory_order_acquire);
+			if (stopping.load()) break;
+			job(thread_id);
+			if (running.fetch_sub(1) == 1) {
+				std::unique_lock<std::mutex> lock(mutex);
+				cond_done.notify_all();
+			}
+		}
+	}
+public:
+	ThreadPool(int threads, bool pin = true) : threads(threads) {
+		generation.store(0);
+		running.store(0);
+		stopping.store(false);
+		// 只绑到进程允许用的CPU上（taskset、cgroup的cpuset）
+		std::vector<int> cpus;
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (pin && sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+			for (int cpu=0;cpu<CPU_SETSIZE;cpu++) {
+				if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+			}
+		}
+		for (int ti=0;ti<threads;ti++) {
+			workers.emplace_back(&ThreadPool::worker_loop, this, ti);
+			if (threads <= (int)cpus.size()) {
+				cpu_set_t cpuset;
+				CPU_ZERO(&cpuset);
+				CPU_SET(cpus[ti], &cpuset);
+				pthread_setaffinity_np(workers[ti].native_handle(), sizeof(cpu_set_t), &cpuset);
+			}
+		}
+	}
+	~ThreadPool() {
+		stopping.store(true);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			generation.fetch_add(1, std::memory_order_release);
+		}
+		cond_start.notify_all();
+		for (int ti=0;ti<threads;ti++) {
+			workers[ti].join();
+		}
+		if (shared() == this) shared() = nullptr;
+	}
+	int size() {
+		return threads;
+	}
+	// 由第一个创建的Graph注册，BigVector::fill和Bitmap::clear/fill也用它
+	static ThreadPool *& shared() {
+		static ThreadPool * pool = nullptr;
+		return pool;
+	}
+	void start(std::function<void(int)> job) {
+		assert(!in_pool());
+		this->job = job;
+		running.store(threads, std::memory_order_relaxed);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			generation.fetch_add(1, std::memory_order_release);
+		}
+		cond_start.notify_all();
+	}
+	void wait() {
+		int spins = 0;
+		while (running.load(std::memory_order_acquire) > 0 && spins < SPINS) {
+			spins++;
+		}
+		if (running.load(std::memory_order_acquire) > 0) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cond_done.wait(lock, [&]{ return running.load(std::memory_order_acquire) == 0; });
+		}
+	}
+	void run(std::function<void(int)> job) {
+		start(job);
+		wait();
+	}
+	/**
+	 * @brief 把[0, length)均分给所有worker，f(begin_i, end_i)。没有可用的线程池（或已在worker里）时在当前线程串行执行。
+	 */
+	template <typename F>
+	static void parallel_range(size_t length, F f) {
+		ThreadPool * pool = shared();
+		if (pool == nullptr || in_pool()) {
+			f((size_t)0, length);
+			return;
+		}
+		pool->run([&](int thread_id) {
+			size_t begin_i, end_i;
+			std::tie(begin_i, end_i) = get_partition_range(length, pool->size(), thread_id);
+			f(begin_i, end_i);
+		});
+	}
+};
+
+#endif
@@ -17,15 +17,40 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #ifndef TYPE_H
 #define TYPE_H
 
+#include "core/constants.hpp"
+
+// 默认（紧凑）的点id是32位的；超过2^31个点的图用64位id，下面的类型和Graph都以点id的类型为模板参数
 typedef int VertexId;
 typedef long EdgeId;
 typedef float Weight;
 
-struct Edge {
-	VertexId source;
-	VertexId target;
+template <typename VID>
+struct EdgeT {
+	VID source;
+	VID target;
 	Weight weight;
 };
+typedef EdgeT<VertexId> Edge;
+
+// 一条边在grid里占的字节数：无权图是两个id，带权图是一个EdgeT（32位id时12字节，64位id时按8字节对齐为24字节）
+template <typename VID>
+inline int edge_bytes(int edge_type) {
+	return (edge_type==0) ? sizeof(VID) * 2 : sizeof(EdgeT<VID>);
+}
+
+// preprocess为每个block记录的统计信息（block_stats文件，按row的(i, j)顺序），空block的min > max
+template <typename VID>
+struct BlockStatsT {
+	EdgeId edges;
+	VID min_source;
+	VID max_source;
+	VID min_target;
+	VID max_target;
+	VID distinct_sources;
+	// 第k个桶是block里出度在[2^k, 2^(k+1))的source个数，最后一个桶不设上限
+	VID degree_histogram[DEGREEBUCKETS];
+};
+typedef BlockStatsT<VertexId> BlockStats;
 
 struct MergeStatus {
   int id;
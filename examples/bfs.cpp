@@ -17,16 +17,13 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #include "core/graph.hpp"
 #include "core/util.hpp"
 
-int main(int argc, char ** argv) {
-	if (argc<3) {
-		fprintf(stderr, "usage: bfs [path] [start vertex id] [memory budget in GB]\n");
-		exit(-1);
-	}
-	std::string path = argv[1];
-	VertexId start_vid = atoi(argv[2]);
-	long memory_bytes = (argc>=4)?atol(argv[3])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
-
-	Graph graph(path);
+// VertexId是grid里点id的类型，由main按meta选择
+template <typename VertexId>
+void bfs(std::string path, VertexId start_vid, long memory_bytes) {
+	typedef EdgeT<VertexId> Edge;
+	GraphT<VertexId> graph(path);
+	// 重新编号过的grid里起点的id
+	VertexId root = graph.local_id(start_vid);
 	//这个set_memory_bytes仅仅设置了Graph成员变量的一个long而已。
 	graph.set_memory_bytes(memory_bytes);
 	//这里分配了两个bitmap
@@ -40,38 +37,58 @@ int main(int argc, char ** argv) {
 
 	//这里在初始化bitmap还有parent
 	active_out->clear();
-	active_out->set_bit(start_vid);
+	active_out->set_bit(root);
 	parent.fill(-1);
 	parent.print_address("parent");
-	parent[start_vid] = start_vid;
+	parent[root] = root;
 	VertexId active_vertices = 1;
 
 	double start_time = get_time();
 	int iteration = 0;
+	long streamed_bytes = 0, skipped_bytes = 0;
 	while (active_vertices!=0) {
 		iteration++;
-		printf("%7d: %d\n", iteration, active_vertices);
+		printf("%7d: %ld\n", iteration, (long)active_vertices);
 		std::swap(active_in, active_out);
 		active_out->clear();
 		//这个graph.hint传的是parent，最后会让Graph里的partition_batch的长度等于parent文件字节大小。
 		graph.hint(parent);
 		//这个stream_edges定义了process函数。process函数每次传入一个edge，并依据parent
-		active_vertices = graph.stream_edges<VertexId>([&](Edge & e){
-			if (parent[e.target]==-1) {
-				if (cas(&parent[e.target], -1, e.source)) {
+		active_vertices = graph.template stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e){
+			if (parent.get(e.target)==-1) {
+				if (cas(&parent[e.target], (VertexId)-1, e.source)) {
 					active_out->set_bit(e.target);
 					return 1;
 				}
 			}
 			return 0;
 		}, active_in);
+		streamed_bytes += graph.streamed_bytes();
+		skipped_bytes += graph.skipped_bytes();
 	}
 	double end_time = get_time();
+	printf("streamed %ld bytes of edges, skipped %ld bytes without active sources\n", streamed_bytes, skipped_bytes);
 
-	int discovered_vertices = graph.stream_vertices<VertexId>([&](VertexId i){
-		return parent[i]!=-1;
+	VertexId discovered_vertices = graph.template stream_vertices<VertexId>([&](VertexId i){
+		return parent.get(i)!=-1;
 	});
-	printf("discovered %d vertices from %d in %.2f seconds.\n", discovered_vertices, start_vid, end_time - start_time);
+	printf("discovered %ld vertices from %ld in %.2f seconds.\n", (long)discovered_vertices, (long)start_vid, end_time - start_time);
+	parent.checkpoint();
+}
 
+int main(int argc, char ** argv) {
+	if (argc<3) {
+		fprintf(stderr, "usage: bfs [path] [start vertex id] [memory budget in GB]\n");
+		exit(-1);
+	}
+	std::string path = argv[1];
+	long start_vid = atol(argv[2]);
+	long memory_bytes = (argc>=4)?atol(argv[3])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
+
+	if (vertex_id_bytes(path)==8) {
+		bfs<long>(path, start_vid, memory_bytes);
+	} else {
+		bfs<VertexId>(path, start_vid, memory_bytes);
+	}
 	return 0;
 }
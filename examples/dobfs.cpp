@@ -0,0 +1,121 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "core/graph.hpp"
+#include "core/util.hpp"
+
+// Beamer et al. 的切换阈值：frontier出边数超过未访问点出边数的1/ALPHA时转pull，frontier点数少于|V|/BETA时转回push
+const long ALPHA = 14;
+const long BETA = 24;
+
+int main(int argc, char ** argv) {
+	if (argc<3) {
+		fprintf(stderr, "usage: dobfs [path] [start vertex id] [memory budget in GB]\n");
+		exit(-1);
+	}
+	std::string path = argv[1];
+	VertexId start_vid = atoi(argv[2]);
+	long memory_bytes = (argc>=4)?atol(argv[3])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
+
+	Graph graph(path);
+	// 重新编号过的grid里起点的id
+	VertexId root = graph.local_id(start_vid);
+	graph.set_memory_bytes(memory_bytes);
+	Bitmap * active_in = graph.alloc_bitmap();
+	Bitmap * active_out = graph.alloc_bitmap();
+	BigVector<VertexId> parent(graph.path+"/dparent", graph.vertices);
+	BigVector<VertexId> degree(graph.path+"/degree", graph.vertices);
+	graph.set_vertex_data_bytes( graph.vertices * sizeof(VertexId) * 2 );
+
+	// 有度数文件或CSR索引时直接拿出度，否则多扫一遍边
+	if (graph.degree_available() || graph.sparse_index_available()) {
+		graph.stream_vertices<VertexId>([&](VertexId i){
+			degree[i] = graph.out_degree(i);
+			return 0;
+		});
+	} else {
+		degree.fill(0);
+		graph.stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e){
+			write_add(&degree[e.source], 1);
+			return 0;
+		}, nullptr, 0, 0);
+	}
+	if (!graph.in_index_available()) {
+		printf("no in-edge index (preprocess -s), pull steps fall back to streaming the column grid\n");
+	}
+
+	active_out->clear();
+	active_out->set_bit(root);
+	parent.fill(-1);
+	parent[root] = root;
+	VertexId active_vertices = 1;
+	long frontier_edges = degree.get(root);
+	long unvisited_edges = graph.edges - frontier_edges;
+	bool pull = false;
+
+	double start_time = get_time();
+	int iteration = 0;
+	long streamed_bytes = 0;
+	while (active_vertices!=0) {
+		iteration++;
+		if (pull) {
+			if (active_vertices < graph.vertices / BETA) pull = false;
+		} else {
+			if (frontier_edges > unvisited_edges / ALPHA) pull = true;
+		}
+		printf("%7d: %d (%s)\n", iteration, active_vertices, pull?"pull":"push");
+		std::swap(active_in, active_out);
+		active_out->clear();
+		graph.hint(parent);
+		if (pull) {
+			// 每个未访问的点找到第一个在frontier里的parent就停
+			active_vertices = graph.pull_edges<VertexId>([&](Edge & e){
+				if (active_in->get_bit(e.source) && cas(&parent[e.target], -1, e.source)) {
+					active_out->set_bit(e.target);
+					return 1;
+				}
+				return 0;
+			}, [&](VertexId v){
+				return parent.get(v)==-1;
+			});
+		} else {
+			active_vertices = graph.stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e){
+				if (parent.get(e.target)==-1) {
+					if (cas(&parent[e.target], -1, e.source)) {
+						active_out->set_bit(e.target);
+						return 1;
+					}
+				}
+				return 0;
+			}, active_in);
+		}
+		streamed_bytes += graph.streamed_bytes();
+		frontier_edges = graph.stream_vertices<long>([&](VertexId i){
+			return (long)degree.get(i);
+		}, active_out);
+		unvisited_edges -= frontier_edges;
+	}
+	double end_time = get_time();
+	printf("touched %ld bytes of edges\n", streamed_bytes);
+
+	int discovered_vertices = graph.stream_vertices<VertexId>([&](VertexId i){
+		return parent.get(i)!=-1;
+	});
+	printf("discovered %d vertices from %d in %.2f seconds.\n", discovered_vertices, start_vid, end_time - start_time);
+	parent.checkpoint();
+
+	return 0;
+}
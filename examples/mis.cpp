@@ -43,15 +43,15 @@ int main(int argc, char ** argv) {
 		iteration++;
 		printf("%7d: %d\n", iteration, active_vertices);
 		std::swap(active_in, active_out);
-		graph.stream_edges<VertexId>([&](Edge & e) {
-			if (e.source<e.target && in_mis[e.target]) {
+		graph.stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e) {
+			if (e.source<e.target && in_mis.get(e.target)) {
 				in_mis[e.target] = false;
 			}
 			return 0;
 		}, active_in);
 		active_out->clear();
 		VertexId next_active_vertices = graph.stream_vertices<VertexId>([&](VertexId i){
-			if (in_mis[i]) {
+			if (in_mis.get(i)) {
 				active_out->set_bit(i);
 				return 1;
 			} else {
@@ -65,6 +65,7 @@ int main(int argc, char ** argv) {
 	double end_time = get_time();
 	printf("in_mis: %d\n", active_vertices);
 	printf("time: %.2f seconds\n", end_time - start_time);
+	in_mis.checkpoint();
 
 	return 0;
 }
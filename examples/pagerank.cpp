@@ -16,18 +16,22 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 
 #include "core/graph.hpp"
 
-int main(int argc, char ** argv) {
-	if (argc<3) {
-		fprintf(stderr, "usage: pagerank [path] [iterations] [memory budget in GB]\n");
-		exit(-1);
-	}
-	std::string path = argv[1];
-	int iterations = atoi(argv[2]);
-	long memory_bytes = (argc>=4)?atol(argv[3])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
-
-	Graph graph(path);
+// VertexId是grid里点id的类型，由main按meta选择
+template <typename VertexId>
+void pagerank(std::string path, int iterations, long memory_bytes) {
+	typedef EdgeT<VertexId> Edge;
+	GraphT<VertexId> graph(path);
 	graph.set_memory_bytes(memory_bytes);
-	BigVector<VertexId> degree(graph.path+"/degree", graph.vertices);
+	// 一个target partition只由一个worker更新时，sum不用原子加
+	graph.set_exclusive_targets(true);
+	bool exclusive = graph.targets_exclusive();
+	// preprocess写了out_degree时直接打开，省掉下面这遍扫边
+	BigVector<VertexId> degree;
+	if (graph.degree_available()) {
+		degree.init(graph.path+"/out_degree");
+	} else {
+		degree.init(graph.path+"/degree", graph.vertices);
+	}
 	BigVector<float> pagerank(graph.path+"/pagerank", graph.vertices);
 	BigVector<float> sum(graph.path+"/sum", graph.vertices);
 
@@ -36,20 +40,22 @@ int main(int argc, char ** argv) {
 
 	double begin_time = get_time();
 
-	degree.fill(0);
-	graph.stream_edges<VertexId>(
-		[&](Edge & e){
-			write_add(&degree[e.source], 1);
-			return 0;
-		}, nullptr, 0, 0
-	);
-	printf("degree calculation used %.2f seconds\n", get_time() - begin_time);
-	fflush(stdout);
+	if (!graph.degree_available()) {
+		degree.fill(0);
+		graph.template stream_edges<VertexId, PROPERTY_NONE>(
+			[&](Edge & e){
+				write_add(&degree[e.source], (VertexId)1);
+				return 0;
+			}, nullptr, 0, 0
+		);
+		printf("degree calculation used %.2f seconds\n", get_time() - begin_time);
+		fflush(stdout);
+	}
 
 	graph.hint(pagerank, sum);
-	graph.stream_vertices<VertexId>(
+	graph.template stream_vertices<VertexId>(
 		[&](VertexId i){
-			pagerank[i] = 1.f / degree[i];
+			pagerank[i] = 1.f / degree.get(i);
 			sum[i] = 0;
 			return 0;
 		}, nullptr, 0,
@@ -65,23 +71,27 @@ int main(int argc, char ** argv) {
 
 	for (int iter=0;iter<iterations;iter++) {
 		graph.hint(pagerank);
-		graph.stream_edges<VertexId>(
+		graph.template stream_edges<VertexId, PROPERTY_NONE>(
 			[&](Edge & e){
-				write_add(&sum[e.target], pagerank[e.source]);
+				if (exclusive) {
+					sum[e.target] += pagerank.get(e.source);
+				} else {
+					write_add(&sum[e.target], pagerank.get(e.source));
+				}
 				return 0;
 			}, nullptr, 0, 1,
 			[&](std::pair<VertexId,VertexId> source_vid_range){
-				pagerank.lock(source_vid_range.first, source_vid_range.second);
+				pagerank.pin(source_vid_range.first, source_vid_range.second);
 			},
 			[&](std::pair<VertexId,VertexId> source_vid_range){
-				pagerank.unlock(source_vid_range.first, source_vid_range.second);
+				pagerank.unpin(source_vid_range.first, source_vid_range.second);
 			}
 		);
 		graph.hint(pagerank, sum);
 		if (iter==iterations-1) {
-			graph.stream_vertices<VertexId>(
+			graph.template stream_vertices<VertexId>(
 				[&](VertexId i){
-					pagerank[i] = 0.15f + 0.85f * sum[i];
+					pagerank[i] = 0.15f + 0.85f * sum.get(i);
 					return 0;
 				}, nullptr, 0,
 				[&](std::pair<VertexId,VertexId> vid_range){
@@ -92,9 +102,9 @@ int main(int argc, char ** argv) {
 				}
 			);
 		} else {
-			graph.stream_vertices<float>(
+			graph.template stream_vertices<float>(
 				[&](VertexId i){
-					pagerank[i] = (0.15f + 0.85f * sum[i]) / degree[i];
+					pagerank[i] = (0.15f + 0.85f * sum.get(i)) / degree.get(i);
 					sum[i] = 0;
 					return 0;
 				}, nullptr, 0,
@@ -112,5 +122,22 @@ int main(int argc, char ** argv) {
 
 	double end_time = get_time();
 	printf("%d iterations of pagerank took %.2f seconds\n", iterations, end_time - begin_time);
+	pagerank.checkpoint();
+}
+
+int main(int argc, char ** argv) {
+	if (argc<3) {
+		fprintf(stderr, "usage: pagerank [path] [iterations] [memory budget in GB]\n");
+		exit(-1);
+	}
+	std::string path = argv[1];
+	int iterations = atoi(argv[2]);
+	long memory_bytes = (argc>=4)?atol(argv[3])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
 
+	if (vertex_id_bytes(path)==8) {
+		pagerank<long>(path, iterations, memory_bytes);
+	} else {
+		pagerank<VertexId>(path, iterations, memory_bytes);
+	}
+	return 0;
 }
@@ -63,11 +63,11 @@ int main(int argc, char ** argv) {
 		int next = 1 - now;
 		std::swap(active_in, active_out);
 		active_out->clear();
-		active_vertices = graph.stream_edges<VertexId>([&](Edge & e) {
-			if (visited[e.target][now] != visited[e.source][now]) {
-				__sync_fetch_and_or( &visited[e.target][next], visited[e.source][now] );
-				VertexId old_radii = radii[e.target];
-				if (radii[e.target]!=iteration) {
+		active_vertices = graph.stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e) {
+			if (visited.get(e.target)[now] != visited.get(e.source)[now]) {
+				__sync_fetch_and_or( &visited[e.target][next], visited.get(e.source)[now] );
+				VertexId old_radii = radii.get(e.target);
+				if (radii.get(e.target)!=iteration) {
 					if (cas(&radii[e.target], old_radii, iteration)) {
 						active_out->set_bit(e.target);
 						return 1;
@@ -77,21 +77,21 @@ int main(int argc, char ** argv) {
 			return 0;
 		}, active_in);
 		active_vertices = graph.stream_vertices<VertexId>([&](VertexId i){
-			visited[i][now] = visited[i][next];
+			visited[i][now] = visited.get(i)[next];
 			return 1;
 		}, active_out); // necessary?
 	}
 	max_radii = 0;
 	for (VertexId i=0;i<graph.vertices;i++) {
-		if (max_radii < radii[i]) {
-			max_radii = radii[i];
+		if (max_radii < radii.get(i)) {
+			max_radii = radii.get(i);
 		}
 	}
 	std::vector<VertexId> candidates;
 	VertexId threshold = 0;
 	while (candidates.size()<K) {
 		for (VertexId i=0;i<graph.vertices;i++) {
-			if (radii[i]==max_radii-threshold) candidates.push_back(i);
+			if (radii.get(i)==max_radii-threshold) candidates.push_back(i);
 		}
 		threshold++;
 	}
@@ -119,11 +119,11 @@ int main(int argc, char ** argv) {
 		int next = 1 - now;
 		std::swap(active_in, active_out);
 		active_out->clear();
-		active_vertices = graph.stream_edges<VertexId>([&](Edge & e) {
-			if (visited[e.target][now] != visited[e.source][now]) {
-				__sync_fetch_and_or( &visited[e.target][next], visited[e.source][now] );
-				VertexId old_radii = radii[e.target];
-				if (radii[e.target]!=iteration) {
+		active_vertices = graph.stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e) {
+			if (visited.get(e.target)[now] != visited.get(e.source)[now]) {
+				__sync_fetch_and_or( &visited[e.target][next], visited.get(e.source)[now] );
+				VertexId old_radii = radii.get(e.target);
+				if (radii.get(e.target)!=iteration) {
 					if (cas(&radii[e.target], old_radii, iteration)) {
 						active_out->set_bit(e.target);
 						return 1;
@@ -133,14 +133,14 @@ int main(int argc, char ** argv) {
 			return 0;
 		}, active_in);
 		active_vertices = graph.stream_vertices<VertexId>([&](VertexId i){
-			visited[i][now] = visited[i][next];
+			visited[i][now] = visited.get(i)[next];
 			return 1;
 		}, active_out); // necessary?
 	}
 	max_radii = 0;
 	for (VertexId i=0;i<graph.vertices;i++) {
-		if (max_radii < radii[i]) {
-			max_radii = radii[i];
+		if (max_radii < radii.get(i)) {
+			max_radii = radii.get(i);
 		}
 	}
 	printf("radii: %d\n", max_radii);
@@ -148,6 +148,7 @@ int main(int argc, char ** argv) {
 	double end_time = get_time();
 	printf("radii: %d\n", max_radii);
 	printf("time: %.2f seconds\n", end_time - start_time);
+	radii.checkpoint();
 
 	return 0;
 }
@@ -27,6 +27,9 @@ int main(int argc, char ** argv) {
 	Graph graph(path);
 	assert(graph.edge_type==1);
 	graph.set_memory_bytes(memory_bytes);
+	// 一个target partition只由一个worker更新时，output不用原子加
+	graph.set_exclusive_targets(true);
+	bool exclusive = graph.targets_exclusive();
 	BigVector<float> input(graph.path+"/input", graph.vertices);
 	BigVector<float> output(graph.path+"/output", graph.vertices);
 	graph.set_vertex_data_bytes( (long) graph.vertices * ( sizeof(float) * 2 ) );
@@ -49,19 +52,24 @@ int main(int argc, char ** argv) {
 		}
 	);
 	graph.hint(input);
-	graph.stream_edges<float>(
+	graph.stream_edges<float, PROPERTY_WEIGHT>(
 		[&](Edge & e){
-			write_add(&output[e.target], input[e.source] * e.weight);
+			if (exclusive) {
+				output[e.target] += input.get(e.source) * e.weight;
+			} else {
+				write_add(&output[e.target], input.get(e.source) * e.weight);
+			}
 			return 0;
 		}, nullptr, 0, 1,
 		[&](std::pair<VertexId,VertexId> source_vid_range){
-			input.lock(source_vid_range.first, source_vid_range.second);
+			input.pin(source_vid_range.first, source_vid_range.second);
 		},
 		[&](std::pair<VertexId,VertexId> source_vid_range){
-			input.unlock(source_vid_range.first, source_vid_range.second);
+			input.unpin(source_vid_range.first, source_vid_range.second);
 		}
 	);
 	double end_time = get_time();
 
 	printf("spmv took %.2f seconds\n", end_time - begin_time);
+	output.checkpoint();
 }
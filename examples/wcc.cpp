@@ -16,15 +16,11 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 
 #include "core/graph.hpp"
 
-int main(int argc, char ** argv) {
-	if (argc<2) {
-		fprintf(stderr, "usage: wcc [path] [memory budget in GB]\n");
-		exit(-1);
-	}
-	std::string path = argv[1];
-	long memory_bytes = (argc>=3)?atol(argv[2])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
-
-	Graph graph(path);
+// VertexId是grid里点id的类型，由main按meta选择
+template <typename VertexId>
+void wcc(std::string path, long memory_bytes) {
+	typedef EdgeT<VertexId> Edge;
+	GraphT<VertexId> graph(path);
 	graph.set_memory_bytes(memory_bytes);
 	Bitmap * active_in = graph.alloc_bitmap();
 	Bitmap * active_out = graph.alloc_bitmap();
@@ -32,41 +28,60 @@ int main(int argc, char ** argv) {
 	graph.set_vertex_data_bytes( graph.vertices * sizeof(VertexId) );
 
 	active_out->fill();
-	VertexId active_vertices = graph.stream_vertices<VertexId>([&](VertexId i){
+	VertexId active_vertices = graph.template stream_vertices<VertexId>([&](VertexId i){
 		label[i] = i;
 		return 1;
 	});
 
 	double start_time = get_time();
 	int iteration = 0;
+	long streamed_bytes = 0, skipped_bytes = 0;
 	while (active_vertices!=0) {
 		iteration++;
-		printf("%7d: %d\n", iteration, active_vertices);
+		printf("%7d: %ld\n", iteration, (long)active_vertices);
 		std::swap(active_in, active_out);
 		active_out->clear();
 		graph.hint(label);
-		active_vertices = graph.stream_edges<VertexId>([&](Edge & e){
-			if (label[e.source]<label[e.target]) {
-				if (write_min(&label[e.target], label[e.source])) {
+		active_vertices = graph.template stream_edges<VertexId, PROPERTY_NONE>([&](Edge & e){
+			if (label.get(e.source)<label.get(e.target)) {
+				if (write_min(&label[e.target], label.get(e.source))) {
 					active_out->set_bit(e.target);
 					return 1;
 				}
 			}
 			return 0;
 		}, active_in);
+		streamed_bytes += graph.streamed_bytes();
+		skipped_bytes += graph.skipped_bytes();
 	}
 	double end_time = get_time();
+	printf("streamed %ld bytes of edges, skipped %ld bytes without active sources\n", streamed_bytes, skipped_bytes);
 
 	BigVector<VertexId> label_stat(graph.path+"/label_stat", graph.vertices);
 	label_stat.fill(0);
-	graph.stream_vertices<VertexId>([&](VertexId i){
-		write_add(&label_stat[label[i]], 1);
+	graph.template stream_vertices<VertexId>([&](VertexId i){
+		write_add(&label_stat[label.get(i)], (VertexId)1);
 		return 1;
 	});
-	VertexId components = graph.stream_vertices<VertexId>([&](VertexId i){
-		return label_stat[i]!=0;
+	VertexId components = graph.template stream_vertices<VertexId>([&](VertexId i){
+		return label_stat.get(i)!=0;
 	});
-	printf("%d components found in %.2f seconds\n", components, end_time - start_time);
+	printf("%ld components found in %.2f seconds\n", (long)components, end_time - start_time);
+	label.checkpoint();
+}
 
+int main(int argc, char ** argv) {
+	if (argc<2) {
+		fprintf(stderr, "usage: wcc [path] [memory budget in GB]\n");
+		exit(-1);
+	}
+	std::string path = argv[1];
+	long memory_bytes = (argc>=3)?atol(argv[2])*1024l*1024l*1024l:8l*1024l*1024l*1024l;
+
+	if (vertex_id_bytes(path)==8) {
+		wcc<long>(path, memory_bytes);
+	} else {
+		wcc<VertexId>(path, memory_bytes);
+	}
 	return 0;
 }
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+#include <tuple>
+
+#include "core/queue.hpp"
+#include "core/time.hpp"
+
+// moves items tuples through a queue from producers to consumers, returns million items per second
+template <typename Q>
+double run(Q & queue, int producers, int consumers, long items, int batch) {
+	std::vector<std::thread> threads;
+	double start_time = get_time();
+	for (int ti=0;ti<consumers;ti++) {
+		threads.emplace_back([&]() {
+			std::tuple<void *, long, long> * buffer = new std::tuple<void *, long, long> [batch];
+			bool done = false;
+			while (!done) {
+				size_t n = queue.pop_batch(buffer, batch);
+				for (size_t k=0;k<n;k++) {
+					if (std::get<0>(buffer[k])==NULL) {
+						for (k++;k<n;k++) queue.push(buffer[k]);
+						done = true;
+						break;
+					}
+				}
+			}
+			delete [] buffer;
+		});
+	}
+	std::vector<std::thread> producer_threads;
+	for (int ti=0;ti<producers;ti++) {
+		producer_threads.emplace_back([&](int thread_id) {
+			for (long i=thread_id;i<items;i+=producers) {
+				queue.push(std::make_tuple((void *)&queue, i, 0l));
+			}
+		}, ti);
+	}
+	for (int ti=0;ti<producers;ti++) {
+		producer_threads[ti].join();
+	}
+	for (int ti=0;ti<consumers;ti++) {
+		queue.push(std::make_tuple((void *)NULL, 0l, 0l));
+	}
+	for (int ti=0;ti<consumers;ti++) {
+		threads[ti].join();
+	}
+	return items / (get_time() - start_time) / 1e6;
+}
+
+// the locked queue has no batch pop, give it one so both run the same loop
+template <typename T>
+struct LockedQueue : public Queue<T> {
+	LockedQueue(size_t capacity) : Queue<T>(capacity) { }
+	size_t pop_batch(T * items, size_t max) {
+		items[0] = this->pop();
+		return 1;
+	}
+};
+
+int main(int argc, char ** argv) {
+	int opt;
+	int producers = 1;
+	int consumers = std::thread::hardware_concurrency();
+	long items = 10000000;
+	int batch = 8;
+	size_t capacity = 65536;
+	while ((opt = getopt(argc, argv, "p:c:n:b:q:")) != -1) {
+		switch (opt) {
+		case 'p':
+			producers = atoi(optarg);
+			break;
+		case 'c':
+			consumers = atoi(optarg);
+			break;
+		case 'n':
+			items = atol(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'q':
+			capacity = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s -p [producers] -c [consumers] -n [items] -b [pop batch] -q [capacity]\n", argv[0]);
+			exit(-1);
+		}
+	}
+	printf("%d producers, %d consumers, %ld items, capacity %lu\n", producers, consumers, items, capacity);
+	{
+		LockedQueue<std::tuple<void *, long, long> > queue(capacity);
+		printf("Queue:              %8.2f Mops/s\n", run(queue, producers, consumers, items, 1));
+	}
+	{
+		RingQueue<std::tuple<void *, long, long> > queue(capacity);
+		printf("RingQueue:          %8.2f Mops/s\n", run(queue, producers, consumers, items, 1));
+	}
+	{
+		RingQueue<std::tuple<void *, long, long> > queue(capacity);
+		printf("RingQueue batch %-3d %8.2f Mops/s\n", batch, run(queue, producers, consumers, items, batch));
+	}
+	return 0;
+}
@@ -22,10 +22,20 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <sys/mman.h>
 
 #include <string>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <type_traits>
 
 #include "core/constants.hpp"
 #include "core/type.hpp"
@@ -34,10 +44,105 @@ Copyright (c) 2014-2015 Xiaowei Zhu, Tsinghua University
 #include "core/partition.hpp"
 #include "core/time.hpp"
 #include "core/atomic.hpp"
+#include "core/aio.hpp"
+#include "core/compress.hpp"
 
 long PAGESIZE = 4096;
 
-void generate_edge_grid(std::string input, std::string output, VertexId vertices, int partitions, int edge_type) {
+// 记录每个SUMMARYSIZE区间里边的source范围（min, max），stream_edges据此跳过没有活跃source的区间。
+// scatter时多个线程会写同一个区间，先在本地按区间合并再原子地更新
+template <typename VertexId>
+void summarize_sources(VertexId * summary, const char * buffer, long bytes, long file_offset, int edge_unit) {
+	long region = -1;
+	VertexId min_source = 0, max_source = 0;
+	for (long pos=0;pos<bytes;pos+=edge_unit) {
+		VertexId source = *(VertexId*)(buffer+pos);
+		long r = (file_offset + pos) / SUMMARYSIZE;
+		if (r!=region) {
+			if (region!=-1) {
+				write_min(&summary[region*2], min_source);
+				write_max(&summary[region*2+1], max_source);
+			}
+			region = r;
+			min_source = max_source = source;
+		}
+		if (source < min_source) min_source = source;
+		if (source > max_source) max_source = source;
+	}
+	if (region!=-1) {
+		write_min(&summary[region*2], min_source);
+		write_max(&summary[region*2+1], max_source);
+	}
+}
+
+template <typename VertexId>
+void write_summary(std::string filename, VertexId * summary, long regions) {
+	int fout = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	assert(write(fout, summary, sizeof(VertexId) * 2 * regions)==(long)sizeof(VertexId) * 2 * regions);
+	close(fout);
+}
+
+void pwrite_full(int fd, const char * buf, long len, long off) {
+	while (len > 0) {
+		long bytes = pwrite(fd, buf, len, off);
+		assert(bytes > 0);
+		buf += bytes;
+		len -= bytes;
+		off += bytes;
+	}
+}
+
+/**
+ * @brief 一个线程的写合并buffer：SCATTERBUFFER字节平分给blocks个block（每份是edge_unit的整数倍），
+ * 边先攒在所在block的那一份里，攒满（或flush_all时）才调用flush(block, data, bytes)写出一次。
+ */
+class WriteCombiner {
+	char * data;
+	int * used;
+	long blocks;
+	long slot;
+	int edge_unit;
+public:
+	WriteCombiner(long blocks, int edge_unit) : blocks(blocks), edge_unit(edge_unit) {
+		slot = std::max(1l, SCATTERBUFFER / blocks / edge_unit) * edge_unit;
+		data = (char *) memalign(PAGESIZE, slot * blocks);
+		used = new int [blocks]();
+	}
+	~WriteCombiner() {
+		free(data);
+		delete [] used;
+	}
+	template <typename F>
+	void append(long block, const char * edge, F flush) {
+		char * buffer = data + block * slot;
+		memcpy(buffer + used[block], edge, edge_unit);
+		used[block] += edge_unit;
+		if (used[block]==slot) {
+			flush(block, buffer, slot);
+			used[block] = 0;
+		}
+	}
+	template <typename F>
+	void flush_all(F flush) {
+		for (long block=0;block<blocks;block++) {
+			if (used[block] > 0) {
+				flush(block, data + block * slot, used[block]);
+				used[block] = 0;
+			}
+		}
+	}
+};
+
+/**
+ * @brief 生成column和row，不产生P²个block文件，打开的文件数和P无关。
+ * P不大时分两遍：第一遍并行统计每个block的边数，算出两个文件里每个block的位置；
+ * 第二遍每个线程把边攒到自己的写合并buffer（WriteCombiner）里，某个block攒满后在block里原子地占一段位置，直接pwrite到column和row的最终位置。
+ * P很大时每个block分到的边太少，改为先按source partition把边分到至多MAXBUCKETS个bucket文件里，
+ * 再由各线程逐个处理bucket：小的bucket读进内存按block排序后写出，大的分段读，先统计block大小，再经过写合并buffer写到最终位置，内存不随bucket变大。
+ */
+template <typename VertexId>
+void generate_edge_grid(std::string input, std::string output, VertexId vertices, int partitions, int edge_type, const PartitionMapT<VertexId> & partition_map) {
 	int parallelism = std::thread::hardware_concurrency();
 	int edge_unit;
 	EdgeId edges;
@@ -47,14 +152,14 @@ void generate_edge_grid(std::string input, std::string output, VertexId vertices
 		edges = file_size(input) / edge_unit;
 		break;
 	case 1:
-		edge_unit = sizeof(VertexId) * 2 + sizeof(Weight);
+		edge_unit = sizeof(EdgeT<VertexId>);
 		edges = file_size(input) / edge_unit;
 		break;
 	default:
 		fprintf(stderr, "edge type (%d) is not supported.\n", edge_type);
 		exit(-1);
 	}
-	printf("vertices = %d, edges = %ld\n", vertices, edges);
+	printf("vertices = %ld, edges = %ld\n", (long)vertices, edges);
 
 	char ** buffers = new char * [parallelism*2];
 	bool * occupied = new bool [parallelism*2];
@@ -62,257 +167,1624 @@ void generate_edge_grid(std::string input, std::string output, VertexId vertices
 		buffers[i] = (char *)memalign(PAGESIZE, IOSIZE);
 		occupied[i] = false;
 	}
-	Queue<std::tuple<int, long> > tasks(parallelism);
-	int ** fout;
-	std::mutex ** mutexes;
-	fout = new int * [partitions];
-	mutexes = new std::mutex * [partitions];
-	if (file_exists(output)) {
-		remove_directory(output);
+	long total_bytes = file_size(input);
+	double start_time = get_time();
+
+	// 读线程把输入按IOSIZE切块交给worker，process(ti, buffer, bytes)在worker线程ti上处理一块
+	auto shuffle = [&](std::function<void(int, char *, long)> process) {
+		RingQueue<std::tuple<int, long> > tasks(parallelism);
+		std::vector<std::thread> threads;
+		for (int ti=0;ti<parallelism;ti++) {
+			threads.emplace_back([&, ti]() {
+				while (true) {
+					int cursor;
+					long bytes;
+					std::tie(cursor, bytes) = tasks.pop();
+					if (cursor==-1) break;
+					process(ti, buffers[cursor], bytes);
+					__atomic_store_n(&occupied[cursor], false, __ATOMIC_RELEASE);
+				}
+			});
+		}
+		int fin = open(input.c_str(), O_RDONLY);
+		if (fin==-1) printf("%s\n", strerror(errno));
+		assert(fin!=-1);
+		int cursor = 0;
+		long read_bytes = 0;
+		while (true) {
+			long bytes = read(fin, buffers[cursor], IOSIZE);
+			assert(bytes!=-1);
+			if (bytes==0) break;
+			occupied[cursor] = true;
+			tasks.push(std::make_tuple(cursor, bytes));
+			read_bytes += bytes;
+			printf("progress: %.2f%%\r", 100. * read_bytes / total_bytes);
+			fflush(stdout);
+			while (__atomic_load_n(&occupied[cursor], __ATOMIC_ACQUIRE)) {
+				cursor = (cursor + 1) % (parallelism * 2);
+			}
+		}
+		close(fin);
+		assert(read_bytes==edges*edge_unit);
+		for (int ti=0;ti<parallelism;ti++) {
+			tasks.push(std::make_tuple(-1, 0));
+		}
+		for (int ti=0;ti<parallelism;ti++) {
+			threads[ti].join();
+		}
+	};
+
+	auto check_edge = [&](VertexId source, VertexId target) {
+		if (source<0 || source>=vertices || target<0 || target>=vertices) {
+			printf("edge (%ld, %ld) exceeds the vertex range [0, %ld)!\n", (long)source, (long)target, (long)vertices);
+			exit(-1);
+		}
+	};
+
+	long * column_offset = new long [partitions*partitions+1];
+	long * row_offset = new long [partitions*partitions+1];
+	int fout_column = open((output+"/column").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	int fout_row = open((output+"/row").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout_column!=-1 && fout_row!=-1);
+	assert(ftruncate(fout_column, total_bytes)==0);
+	assert(ftruncate(fout_row, total_bytes)==0);
+	long regions = (total_bytes + SUMMARYSIZE - 1) / SUMMARYSIZE;
+	VertexId * column_summary = new VertexId [regions * 2];
+	VertexId * row_summary = new VertexId [regions * 2];
+	for (long r=0;r<regions;r++) {
+		column_summary[r*2] = row_summary[r*2] = vertices;
+		column_summary[r*2+1] = row_summary[r*2+1] = -1;
 	}
-	create_directory(output);
 
-	const int grid_buffer_size = 768; // 12 * 8 * 8
-	char * global_grid_buffer = (char *) memalign(PAGESIZE, grid_buffer_size * partitions * partitions);
-	char *** grid_buffer = new char ** [partitions];
-	int ** grid_buffer_offset = new int * [partitions];
-	for (int i=0;i<partitions;i++) {
-		mutexes[i] = new std::mutex [partitions];
-		fout[i] = new int [partitions];
-		grid_buffer[i] = new char * [partitions];
-		grid_buffer_offset[i] = new int [partitions];
+	if (partitions <= SCATTERPARTITIONS) {
+		// 每个线程统计一块输入里各个block的边数
+		int ** local_grid_offset = new int * [parallelism];
+		for (int ti=0;ti<parallelism;ti++) {
+			local_grid_offset[ti] = new int [partitions * partitions];
+		}
+
+		// 第一遍：block大小
+		long * block_bytes = new long [partitions*partitions]();
+		shuffle([&](int ti, char * buffer, long bytes) {
+			int * grid_offset = local_grid_offset[ti];
+			memset(grid_offset, 0, sizeof(int) * partitions * partitions);
+			for (long pos=0;pos<bytes;pos+=edge_unit) {
+				VertexId source = *(VertexId*)(buffer+pos);
+				VertexId target = *(VertexId*)(buffer+pos+sizeof(VertexId));
+				check_edge(source, target);
+				grid_offset[partition_map.id(source)*partitions+partition_map.id(target)] += edge_unit;
+			}
+			for (int ij=0;ij<partitions*partitions;ij++) {
+				if (local_grid_offset[ti][ij]!=0) {
+					__sync_fetch_and_add(&block_bytes[ij], (long)local_grid_offset[ti][ij]);
+				}
+			}
+		});
+		printf("it takes %.2f seconds to count edge blocks\n", get_time() - start_time);
+
+		long offset = 0;
 		for (int j=0;j<partitions;j++) {
+			for (int i=0;i<partitions;i++) {
+				column_offset[j*partitions+i] = offset;
+				offset += block_bytes[i*partitions+j];
+			}
+		}
+		column_offset[partitions*partitions] = offset;
+		offset = 0;
+		for (int ij=0;ij<partitions*partitions;ij++) {
+			row_offset[ij] = offset;
+			offset += block_bytes[ij];
+		}
+		row_offset[partitions*partitions] = offset;
+		assert(offset==total_bytes);
+
+		// 每个block里已经占用的字节数
+		long * block_cursor = new long [partitions*partitions]();
+		auto scatter = [&](long ij, const char * buffer, long bytes) {
+			int i = ij / partitions;
+			int j = ij % partitions;
+			long pos = __sync_fetch_and_add(&block_cursor[ij], bytes);
+			assert(pos + bytes <= block_bytes[i*partitions+j]);
+			pwrite_full(fout_column, buffer, bytes, column_offset[j*partitions+i] + pos);
+			pwrite_full(fout_row, buffer, bytes, row_offset[i*partitions+j] + pos);
+			summarize_sources(column_summary, buffer, bytes, column_offset[j*partitions+i] + pos, edge_unit);
+			summarize_sources(row_summary, buffer, bytes, row_offset[i*partitions+j] + pos, edge_unit);
+		};
+
+		// 第二遍：边攒在各线程的写合并buffer里，一个block攒满一份就写到最终位置
+		WriteCombiner ** combiners = new WriteCombiner * [parallelism];
+		for (int ti=0;ti<parallelism;ti++) {
+			combiners[ti] = new WriteCombiner((long)partitions*partitions, edge_unit);
+		}
+		shuffle([&](int ti, char * buffer, long bytes) {
+			WriteCombiner * combiner = combiners[ti];
+			for (long pos=0;pos<bytes;pos+=edge_unit) {
+				VertexId source = *(VertexId*)(buffer+pos);
+				VertexId target = *(VertexId*)(buffer+pos+sizeof(VertexId));
+				combiner->append(partition_map.id(source)*partitions+partition_map.id(target), buffer+pos, scatter);
+			}
+		});
+		std::vector<std::thread> threads;
+		for (int ti=0;ti<parallelism;ti++) {
+			threads.emplace_back([&, ti]() {
+				combiners[ti]->flush_all(scatter);
+				delete combiners[ti];
+			});
+		}
+		for (int ti=0;ti<parallelism;ti++) {
+			threads[ti].join();
+		}
+		for (int ij=0;ij<partitions*partitions;ij++) {
+			assert(block_cursor[ij]==block_bytes[ij]);
+		}
+
+		for (int ti=0;ti<parallelism;ti++) {
+			delete [] local_grid_offset[ti];
+		}
+		delete [] local_grid_offset;
+		delete [] combiners;
+		delete [] block_bytes;
+		delete [] block_cursor;
+	} else {
+		char ** local_buffer = new char * [parallelism];
+		int ** local_block_id = new int * [parallelism];
+		for (int ti=0;ti<parallelism;ti++) {
+			local_buffer[ti] = (char *) memalign(PAGESIZE, IOSIZE);
+			local_block_id[ti] = new int [IOSIZE / sizeof(VertexId) / 2];
+		}
+
+		// bucket b包含source partition [bucket_begin[b], bucket_begin[b+1])
+		int buckets = std::min(partitions, MAXBUCKETS);
+		int * bucket_begin = new int [buckets+1];
+		int * partition_bucket = new int [partitions];
+		for (int b=0;b<=buckets;b++) {
+			bucket_begin[b] = (long)partitions * b / buckets;
+		}
+		for (int b=0;b<buckets;b++) {
+			for (int i=bucket_begin[b];i<bucket_begin[b+1];i++) {
+				partition_bucket[i] = b;
+			}
+		}
+		int * fout_bucket = new int [buckets];
+		std::mutex * mutexes = new std::mutex [buckets];
+		for (int b=0;b<buckets;b++) {
 			char filename[4096];
-			sprintf(filename, "%s/block-%d-%d", output.c_str(), i, j);
-			fout[i][j] = open(filename, O_WRONLY|O_APPEND|O_CREAT, 0644);
-			grid_buffer[i][j] = global_grid_buffer + (i * partitions + j) * grid_buffer_size;
-			grid_buffer_offset[i][j] = 0;
+			sprintf(filename, "%s/bucket-%d", output.c_str(), b);
+			fout_bucket[b] = open(filename, O_WRONLY|O_APPEND|O_CREAT|O_TRUNC, 0644);
+			assert(fout_bucket[b]!=-1);
+		}
+		// bucket b里target在partition j的字节数，用来算column里每段的位置
+		long * bucket_column_bytes = new long [(long)buckets*partitions]();
+		int ** local_bucket_offset = new int * [parallelism];
+		int ** local_bucket_cursor = new int * [parallelism];
+		int ** local_column_bytes = new int * [parallelism];
+		for (int ti=0;ti<parallelism;ti++) {
+			local_bucket_offset[ti] = new int [buckets];
+			local_bucket_cursor[ti] = new int [buckets];
+			local_column_bytes[ti] = new int [(long)buckets*partitions];
+		}
+
+		// 第一遍：按bucket计数排序后追加到bucket文件
+		shuffle([&](int ti, char * buffer, long bytes) {
+			int * bucket_offset = local_bucket_offset[ti];
+			int * bucket_cursor = local_bucket_cursor[ti];
+			int * column_bytes = local_column_bytes[ti];
+			int * bucket_id = local_block_id[ti];
+			char * sorted = local_buffer[ti];
+			memset(bucket_offset, 0, sizeof(int) * buckets);
+			memset(column_bytes, 0, sizeof(int) * buckets * partitions);
+			for (long pos=0, k=0;pos<bytes;pos+=edge_unit, k++) {
+				VertexId source = *(VertexId*)(buffer+pos);
+				VertexId target = *(VertexId*)(buffer+pos+sizeof(VertexId));
+				check_edge(source, target);
+				int b = partition_bucket[partition_map.id(source)];
+				int j = partition_map.id(target);
+				bucket_offset[b] += edge_unit;
+				column_bytes[(long)b*partitions+j] += edge_unit;
+				bucket_id[k] = b;
+			}
+			for (long bj=0;bj<(long)buckets*partitions;bj++) {
+				if (column_bytes[bj]!=0) {
+					__sync_fetch_and_add(&bucket_column_bytes[bj], (long)column_bytes[bj]);
+				}
+			}
+			bucket_cursor[0] = 0;
+			for (int b=1;b<buckets;b++) {
+				bucket_cursor[b] = bucket_offset[b-1];
+				bucket_offset[b] += bucket_cursor[b];
+			}
+			assert(bucket_offset[buckets-1]==bytes);
+			for (long pos=0, k=0;pos<bytes;pos+=edge_unit, k++) {
+				memcpy(sorted+bucket_cursor[bucket_id[k]], buffer+pos, edge_unit);
+				bucket_cursor[bucket_id[k]] += edge_unit;
+			}
+			int start = 0;
+			for (int b=0;b<buckets;b++) {
+				if (bucket_offset[b] > start) {
+					std::unique_lock<std::mutex> lock(mutexes[b]);
+					assert(write(fout_bucket[b], sorted+start, bucket_offset[b]-start)==bucket_offset[b]-start);
+				}
+				start = bucket_offset[b];
+			}
+		});
+		for (int b=0;b<buckets;b++) {
+			close(fout_bucket[b]);
+		}
+		printf("it takes %.2f seconds to shuffle edges into %d buckets\n", get_time() - start_time, buckets);
+
+		// bucket b在row里的起点，以及它在column里target partition j那一段的起点
+		long * bucket_row_start = new long [buckets+1];
+		long * bucket_column_start = new long [(long)buckets*partitions];
+		long offset = 0;
+		for (int j=0;j<partitions;j++) {
+			for (int b=0;b<buckets;b++) {
+				bucket_column_start[(long)b*partitions+j] = offset;
+				offset += bucket_column_bytes[(long)b*partitions+j];
+			}
+		}
+		assert(offset==total_bytes);
+		offset = 0;
+		for (int b=0;b<buckets;b++) {
+			bucket_row_start[b] = offset;
+			for (int j=0;j<partitions;j++) {
+				offset += bucket_column_bytes[(long)b*partitions+j];
+			}
+		}
+		bucket_row_start[buckets] = offset;
+
+		// 第二遍：每个线程处理一个bucket。不超过IOSIZE的bucket整个读进来按block计数排序，row一次写出，column每个target partition写一段；
+		// 更大的bucket按IOSIZE分段读，第一遍统计各block的大小，之后经过写合并buffer写到最终位置，block太多时分组多读几遍。每个线程用的内存和bucket多大无关
+		std::atomic<int> next_bucket(0);
+		std::vector<std::thread> threads;
+		for (int ti=0;ti<parallelism;ti++) {
+			threads.emplace_back([&, ti]() {
+				char * buffer = local_buffer[ti];
+				int * block_id = local_block_id[ti];
+				char * sorted = (char *) memalign(PAGESIZE, IOSIZE);
+				long piece = IOSIZE / edge_unit * edge_unit;
+				int b;
+				while ((b = next_bucket.fetch_add(1)) < buckets) {
+					int begin_i = bucket_begin[b];
+					int rows = bucket_begin[b+1] - begin_i;
+					long bytes = bucket_row_start[b+1] - bucket_row_start[b];
+					long blocks = (long)rows*partitions;
+					bool in_memory = bytes <= piece;
+					char filename[4096];
+					sprintf(filename, "%s/bucket-%d", output.c_str(), b);
+					int fin = open(filename, O_RDONLY);
+					assert(fin!=-1);
+					long * block_bytes = new long [blocks]();
+					long * block_cursor = new long [blocks]();
+					for (long offset=0;offset<bytes;offset+=piece) {
+						long length = std::min(piece, bytes - offset);
+						assert(pread_full(fin, buffer, length, offset)==length);
+						for (long pos=0, k=0;pos<length;pos+=edge_unit, k++) {
+							VertexId source = *(VertexId*)(buffer+pos);
+							VertexId target = *(VertexId*)(buffer+pos+sizeof(VertexId));
+							long ij = (long)(partition_map.id(source) - begin_i)*partitions+partition_map.id(target);
+							block_bytes[ij] += edge_unit;
+							if (in_memory) block_id[k] = ij;
+						}
+					}
+					// row里这个bucket的block按(i, j)顺序连续存放；column里target partition j的一段放的是block (begin_i..begin_i+rows-1, j)
+					long row_cursor = bucket_row_start[b];
+					for (long ij=0;ij<blocks;ij++) {
+						row_offset[(long)begin_i*partitions+ij] = row_cursor;
+						row_cursor += block_bytes[ij];
+					}
+					for (int j=0;j<partitions;j++) {
+						long column_cursor = bucket_column_start[(long)b*partitions+j];
+						for (int i=0;i<rows;i++) {
+							column_offset[(long)j*partitions+begin_i+i] = column_cursor;
+							column_cursor += block_bytes[(long)i*partitions+j];
+						}
+					}
+					if (in_memory) {
+						for (long ij=0;ij<blocks;ij++) {
+							block_cursor[ij] = row_offset[(long)begin_i*partitions+ij] - bucket_row_start[b];
+						}
+						for (long pos=0, k=0;pos<bytes;pos+=edge_unit, k++) {
+							memcpy(sorted+block_cursor[block_id[k]], buffer+pos, edge_unit);
+							block_cursor[block_id[k]] += edge_unit;
+						}
+						pwrite_full(fout_row, sorted, bytes, bucket_row_start[b]);
+						summarize_sources(row_summary, sorted, bytes, bucket_row_start[b], edge_unit);
+						long column_cursor = 0;
+						for (int j=0;j<partitions;j++) {
+							long start = column_cursor;
+							for (int i=0;i<rows;i++) {
+								long ij = (long)i*partitions+j;
+								memcpy(buffer+column_cursor, sorted+row_offset[(long)begin_i*partitions+ij]-bucket_row_start[b], block_bytes[ij]);
+								column_cursor += block_bytes[ij];
+							}
+							if (column_cursor > start) {
+								pwrite_full(fout_column, buffer+start, column_cursor-start, bucket_column_start[(long)b*partitions+j]);
+								summarize_sources(column_summary, buffer+start, column_cursor-start, bucket_column_start[(long)b*partitions+j], edge_unit);
+							}
+						}
+					} else {
+						// 每份写合并buffer至少SCATTERSLOT字节，block太多时按[first, last)分组，每组把bucket重读一遍只写组内的block
+						long group_blocks = SCATTERBUFFER / SCATTERSLOT;
+						for (long first=0;first<blocks;first+=group_blocks) {
+							long last = std::min(blocks, first + group_blocks);
+							// block_cursor记下每个block已经写出的字节数
+							auto flush = [&](long block, const char * data, long length) {
+								long ij = first + block;
+								long i = begin_i + ij / partitions;
+								long j = ij % partitions;
+								long row_pos = row_offset[i*partitions+j] + block_cursor[ij];
+								long column_pos = column_offset[j*partitions+i] + block_cursor[ij];
+								block_cursor[ij] += length;
+								pwrite_full(fout_row, data, length, row_pos);
+								pwrite_full(fout_column, data, length, column_pos);
+								summarize_sources(row_summary, data, length, row_pos, edge_unit);
+								summarize_sources(column_summary, data, length, column_pos, edge_unit);
+							};
+							WriteCombiner combiner(last - first, edge_unit);
+							for (long offset=0;offset<bytes;offset+=piece) {
+								long length = std::min(piece, bytes - offset);
+								assert(pread_full(fin, buffer, length, offset)==length);
+								for (long pos=0;pos<length;pos+=edge_unit) {
+									VertexId source = *(VertexId*)(buffer+pos);
+									VertexId target = *(VertexId*)(buffer+pos+sizeof(VertexId));
+									long ij = (long)(partition_map.id(source) - begin_i)*partitions+partition_map.id(target);
+									if (ij >= first && ij < last) {
+										combiner.append(ij - first, buffer+pos, flush);
+									}
+								}
+							}
+							combiner.flush_all(flush);
+						}
+						for (long ij=0;ij<blocks;ij++) {
+							assert(block_cursor[ij]==block_bytes[ij]);
+						}
+					}
+					close(fin);
+					unlink(filename);
+					delete [] block_bytes;
+					delete [] block_cursor;
+				}
+				free(sorted);
+			});
+		}
+		for (int ti=0;ti<parallelism;ti++) {
+			threads[ti].join();
+		}
+		column_offset[partitions*partitions] = total_bytes;
+		row_offset[partitions*partitions] = total_bytes;
+
+		for (int ti=0;ti<parallelism;ti++) {
+			delete [] local_bucket_offset[ti];
+			delete [] local_bucket_cursor[ti];
+			delete [] local_column_bytes[ti];
+			free(local_buffer[ti]);
+			delete [] local_block_id[ti];
 		}
+		delete [] local_buffer;
+		delete [] local_block_id;
+		delete [] local_bucket_offset;
+		delete [] local_bucket_cursor;
+		delete [] local_column_bytes;
+		delete [] bucket_begin;
+		delete [] partition_bucket;
+		delete [] fout_bucket;
+		delete [] mutexes;
+		delete [] bucket_column_bytes;
+		delete [] bucket_row_start;
+		delete [] bucket_column_start;
 	}
+	close(fout_column);
+	close(fout_row);
+
+	int fout_column_offset = open((output+"/column_offset").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(write(fout_column_offset, column_offset, sizeof(long)*(partitions*partitions+1))==(long)sizeof(long)*(partitions*partitions+1));
+	close(fout_column_offset);
+	int fout_row_offset = open((output+"/row_offset").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(write(fout_row_offset, row_offset, sizeof(long)*(partitions*partitions+1))==(long)sizeof(long)*(partitions*partitions+1));
+	close(fout_row_offset);
+	write_summary(output+"/column_summary", column_summary, regions);
+	write_summary(output+"/row_summary", row_summary, regions);
 
+	printf("it takes %.2f seconds to generate edge grid\n", get_time() - start_time);
+
+	for (int i=0;i<parallelism*2;i++) {
+		free(buffers[i]);
+	}
+	delete [] buffers;
+	delete [] occupied;
+	delete [] column_offset;
+	delete [] row_offset;
+	delete [] column_summary;
+	delete [] row_summary;
+
+	FILE * fmeta = fopen((output+"/meta").c_str(), "w");
+	fprintf(fmeta, "%d %ld %ld %d %d", edge_type, (long)vertices, edges, partitions, (int)sizeof(VertexId));
+	fclose(fmeta);
+}
+
+// block内边的排列方式
+#define BLOCKORDER_NONE 0
+#define BLOCKORDER_TARGET 1
+#define BLOCKORDER_SOURCE 2
+#define BLOCKORDER_HILBERT 3
+
+int parse_block_order(std::string name) {
+	if (name=="target") return BLOCKORDER_TARGET;
+	if (name=="source") return BLOCKORDER_SOURCE;
+	if (name=="hilbert") return BLOCKORDER_HILBERT;
+	fprintf(stderr, "unknown block ordering (%s), use target, source or hilbert\n", name.c_str());
+	exit(-1);
+}
+
+// block内排序的key：x、y各占VertexId的位宽（64位id时是128位的key），partition跨2^32个以上的点时也不会冲突
+template <typename VertexId>
+struct BlockKey {
+	typedef typename std::conditional<sizeof(VertexId) <= 4, unsigned long, unsigned __int128>::type type;
+};
+
+// (x, y)在边长为n（2的幂）的Hilbert曲线上的位置
+template <typename Key>
+inline Key hilbert_index(Key n, Key x, Key y) {
+	Key d = 0;
+	for (Key s=n/2;s>0;s/=2) {
+		Key rx = (x & s) > 0;
+		Key ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry==0) {
+			if (rx==1) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+/**
+ * @brief 把每个block里的边按target（target相同时按source）、source或(source, target)的Hilbert曲线顺序排好，
+ * 同一个block在row和column里是同一串字节，排一次写两处。各线程按block并行，最后重新生成两个文件的source summary。
+ * 每个线程一次最多在内存里排run_edges条边，所有线程合起来不超过memory_bytes；更大的block分段排好写回row，
+ * 再多路归并写到column，最后拷回row。
+ */
+template <typename VertexId>
+void sort_blocks(std::string output, VertexId vertices, int partitions, int edge_type, const PartitionMapT<VertexId> & partition_map, int block_order, long memory_bytes) {
+	typedef typename BlockKey<VertexId>::type Key;
+	typedef std::pair<Key, EdgeId> KeyedEdge;
+	int parallelism = std::thread::hardware_concurrency();
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	double start_time = get_time();
+	long * column_offset = new long [partitions*partitions+1];
+	long * row_offset = new long [partitions*partitions+1];
+	int fin_offset = open((output+"/column_offset").c_str(), O_RDONLY);
+	assert(pread_full(fin_offset, (char *)column_offset, sizeof(long)*(partitions*partitions+1), 0)==(long)sizeof(long)*(partitions*partitions+1));
+	close(fin_offset);
+	fin_offset = open((output+"/row_offset").c_str(), O_RDONLY);
+	assert(pread_full(fin_offset, (char *)row_offset, sizeof(long)*(partitions*partitions+1), 0)==(long)sizeof(long)*(partitions*partitions+1));
+	close(fin_offset);
+	long total_bytes = row_offset[partitions*partitions];
+	long regions = (total_bytes + SUMMARYSIZE - 1) / SUMMARYSIZE;
+	VertexId * column_summary = new VertexId [regions * 2];
+	VertexId * row_summary = new VertexId [regions * 2];
+	for (long r=0;r<regions;r++) {
+		column_summary[r*2] = row_summary[r*2] = vertices;
+		column_summary[r*2+1] = row_summary[r*2+1] = -1;
+	}
+	int fd_column = open((output+"/column").c_str(), O_RDWR);
+	int fd_row = open((output+"/row").c_str(), O_RDWR);
+	assert(fd_column!=-1 && fd_row!=-1);
+	// 一条边在内存里排序时占原始、排好的两份加上key
+	long run_edges = std::max(1l << 16, memory_bytes / parallelism / (2 * edge_unit + (long)sizeof(KeyedEdge)));
+	long run_bytes = run_edges * edge_unit;
+
+	std::atomic<long> next_block(0);
 	std::vector<std::thread> threads;
 	for (int ti=0;ti<parallelism;ti++) {
 		threads.emplace_back([&]() {
-			char * local_buffer = (char *) memalign(PAGESIZE, IOSIZE);
-			int * local_grid_offset = new int [partitions * partitions];
-			int * local_grid_cursor = new int [partitions * partitions];
-			VertexId source, target;
-			Weight weight;
-			while (true) {
-				int cursor;
-				long bytes;
-				std::tie(cursor, bytes) = tasks.pop();
-				if (cursor==-1) break;
-				memset(local_grid_offset, 0, sizeof(int) * partitions * partitions);
-				memset(local_grid_cursor, 0, sizeof(int) * partitions * partitions);
-				char * buffer = buffers[cursor];
-				for (long pos=0;pos<bytes;pos+=edge_unit) {
-					source = *(VertexId*)(buffer+pos);
-					target = *(VertexId*)(buffer+pos+sizeof(VertexId));
-					//printf("source:%d\n",source);
-					//printf("target:%d\n",target);
-					int i = get_partition_id(vertices, partitions, source);
-					int j = get_partition_id(vertices, partitions, target);
-					if(i>partitions||j>partitions){
-						printf("parition_id from source=>%d is %d from target=>%d is %d, one of them exceed partition boundary!\n",source,i,target,j);
-						exit(-1);
-					}
-					//printf("\ni:%d\n",i);
-					//printf("\nj:%d\n",j);
-					local_grid_offset[i*partitions+j] += edge_unit;
+			std::vector<char> buffer, sorted;
+			std::vector<KeyedEdge> keys;
+			VertexId source_begin = 0, target_begin = 0;
+			Key n = 1;
+			auto edge_key = [&](const char * edge) -> Key {
+				Key x = *(VertexId*)edge - source_begin;
+				Key y = *(VertexId*)(edge+sizeof(VertexId)) - target_begin;
+				switch (block_order) {
+				case BLOCKORDER_TARGET:
+					return (y << (sizeof(VertexId) * 8)) | x;
+				case BLOCKORDER_SOURCE:
+					return (x << (sizeof(VertexId) * 8)) | y;
+				default:
+					return hilbert_index(n, x, y);
 				}
-				local_grid_cursor[0] = 0;
-				for (int ccy=0;ccy<partitions*partitions;ccy++){
-					printf("partitions_id:%d offset_value:%d\n",ccy, local_grid_offset[ccy]);
+			};
+			// 把data里的edges条边排好放到out，key相同的保持原来的顺序
+			auto sort_run = [&](const char * data, EdgeId edges, char * out) {
+				keys.resize(edges);
+				for (EdgeId e=0;e<edges;e++) {
+					keys[e].first = edge_key(data+e*edge_unit);
+					keys[e].second = e;
 				}
-				//printf("\n");
-				//printf("part*part:%d\n",partitions*partitions);
-				for (int ij=1;ij<partitions*partitions;ij++) {
-					//printf("ij:%lu\n",ij);
-					local_grid_cursor[ij] = local_grid_offset[ij - 1];
-					local_grid_offset[ij] += local_grid_cursor[ij];
+				std::sort(keys.begin(), keys.end());
+				for (EdgeId e=0;e<edges;e++) {
+					memcpy(out+e*edge_unit, data+keys[e].second*edge_unit, edge_unit);
 				}
-				printf("partitions:%d local_grid_offset[part*part-1]:%d bytes:%ld\n",partitions,local_grid_offset[partitions*partitions-1],bytes);
-				assert(local_grid_offset[partitions*partitions-1]==bytes);
-				for (long pos=0;pos<bytes;pos+=edge_unit) {
-					source = *(VertexId*)(buffer+pos);
-					target = *(VertexId*)(buffer+pos+sizeof(VertexId));
-					int i = get_partition_id(vertices, partitions, source);
-					int j = get_partition_id(vertices, partitions, target);
-					*(VertexId*)(local_buffer+local_grid_cursor[i*partitions+j]) = source;
-					*(VertexId*)(local_buffer+local_grid_cursor[i*partitions+j]+sizeof(VertexId)) = target;
-					if (edge_type==1) {
-						weight = *(Weight*)(buffer+pos+sizeof(VertexId)*2);
-						*(Weight*)(local_buffer+local_grid_cursor[i*partitions+j]+sizeof(VertexId)*2) = weight;
-					}
-					local_grid_cursor[i*partitions+j] += edge_unit;
+			};
+			long ij;
+			while ((ij = next_block.fetch_add(1)) < (long)partitions*partitions) {
+				int i = ij / partitions;
+				int j = ij % partitions;
+				long bytes = row_offset[ij+1] - row_offset[ij];
+				if (bytes==0) continue;
+				source_begin = partition_map.range(i).first;
+				target_begin = partition_map.range(j).first;
+				n = 1;
+				while (n < (Key)(partition_map.range(i).second - source_begin) || n < (Key)(partition_map.range(j).second - target_begin)) n *= 2;
+				if (bytes <= run_bytes) {
+					buffer.resize(bytes);
+					sorted.resize(bytes);
+					assert(pread_full(fd_row, buffer.data(), bytes, row_offset[ij])==bytes);
+					sort_run(buffer.data(), bytes / edge_unit, sorted.data());
+					pwrite_full(fd_row, sorted.data(), bytes, row_offset[ij]);
+					pwrite_full(fd_column, sorted.data(), bytes, column_offset[j*partitions+i]);
+					summarize_sources(row_summary, sorted.data(), bytes, row_offset[ij], edge_unit);
+					summarize_sources(column_summary, sorted.data(), bytes, column_offset[j*partitions+i], edge_unit);
+					continue;
 				}
-				int start = 0;
-				for (int ij=0;ij<partitions*partitions;ij++) {
-					assert(local_grid_cursor[ij]==local_grid_offset[ij]);
-					int i = ij / partitions;
-					int j = ij % partitions;
-					std::unique_lock<std::mutex> lock(mutexes[i][j]);
-					if (local_grid_offset[ij] - start > edge_unit) {
-						write(fout[i][j], local_buffer+start, local_grid_offset[ij]-start);
-					} else if (local_grid_offset[ij] - start == edge_unit) {
-						memcpy(grid_buffer[i][j]+grid_buffer_offset[i][j], local_buffer+start, edge_unit);
-						grid_buffer_offset[i][j] += edge_unit;
-						if (grid_buffer_offset[i][j]==grid_buffer_size) {
-							write(fout[i][j], grid_buffer[i][j], grid_buffer_size);
-							grid_buffer_offset[i][j] = 0;
-						}
+				// 每run_bytes排好一段写回row里原来的位置
+				long runs = (bytes + run_bytes - 1) / run_bytes;
+				sorted.resize(run_bytes);
+				buffer.resize(run_bytes);
+				for (long r=0;r<runs;r++) {
+					long length = std::min(run_bytes, bytes - r * run_bytes);
+					assert(pread_full(fd_row, buffer.data(), length, row_offset[ij] + r * run_bytes)==length);
+					sort_run(buffer.data(), length / edge_unit, sorted.data());
+					pwrite_full(fd_row, sorted.data(), length, row_offset[ij] + r * run_bytes);
+				}
+				// 多路归并到column：buffer平分给各段做读入窗口，sorted攒输出。key相同时先取前面的段，和整个block一起排的结果一样
+				long window = std::max(1l, run_bytes / runs / edge_unit) * edge_unit;
+				buffer.resize(std::max(run_bytes, window * runs));
+				std::vector<long> next(runs), end(runs), cursor(runs), filled(runs);
+				auto refill = [&](long r) {
+					filled[r] = std::min(window, end[r] - next[r]);
+					assert(pread_full(fd_row, buffer.data() + r * window, filled[r], row_offset[ij] + next[r])==filled[r]);
+					next[r] += filled[r];
+					cursor[r] = 0;
+				};
+				std::priority_queue<std::pair<Key, long>, std::vector<std::pair<Key, long> >, std::greater<std::pair<Key, long> > > heads;
+				for (long r=0;r<runs;r++) {
+					next[r] = r * run_bytes;
+					end[r] = std::min(bytes, next[r] + run_bytes);
+					refill(r);
+					heads.push(std::make_pair(edge_key(buffer.data() + r * window), r));
+				}
+				long column_start = column_offset[j*partitions+i];
+				long out_bytes = 0, written = 0;
+				auto flush = [&]() {
+					pwrite_full(fd_column, sorted.data(), out_bytes, column_start + written);
+					summarize_sources(column_summary, sorted.data(), out_bytes, column_start + written, edge_unit);
+					written += out_bytes;
+					out_bytes = 0;
+				};
+				while (!heads.empty()) {
+					long r = heads.top().second;
+					heads.pop();
+					memcpy(sorted.data() + out_bytes, buffer.data() + r * window + cursor[r], edge_unit);
+					out_bytes += edge_unit;
+					cursor[r] += edge_unit;
+					if (out_bytes==run_bytes) flush();
+					if (cursor[r]==filled[r]) {
+						if (next[r]==end[r]) continue;
+						refill(r);
 					}
-					start = local_grid_offset[ij];
+					heads.push(std::make_pair(edge_key(buffer.data() + r * window + cursor[r]), r));
+				}
+				if (out_bytes > 0) flush();
+				assert(written==bytes);
+				// 排好的block拷回row
+				for (long offset=0;offset<bytes;offset+=run_bytes) {
+					long length = std::min(run_bytes, bytes - offset);
+					assert(pread_full(fd_column, buffer.data(), length, column_start + offset)==length);
+					pwrite_full(fd_row, buffer.data(), length, row_offset[ij] + offset);
+					summarize_sources(row_summary, buffer.data(), length, row_offset[ij] + offset, edge_unit);
 				}
-				occupied[cursor] = false;
 			}
 		});
 	}
+	for (int ti=0;ti<parallelism;ti++) {
+		threads[ti].join();
+	}
+	close(fd_column);
+	close(fd_row);
+	write_summary(output+"/column_summary", column_summary, regions);
+	write_summary(output+"/row_summary", row_summary, regions);
+	delete [] column_summary;
+	delete [] row_summary;
+	delete [] column_offset;
+	delete [] row_offset;
+	printf("it takes %.2f seconds to sort edges inside blocks\n", get_time() - start_time);
+}
 
-	int fin = open(input.c_str(), O_RDONLY);
-	if (fin==-1) printf("%s\n", strerror(errno));
-	assert(fin!=-1);
-	int cursor = 0;
-	long total_bytes = file_size(input);
-	long read_bytes = 0;
+/**
+ * @brief 把grid（row或column）压缩成grid_compressed：每个block按COMPRESSEDCHUNK条边切成chunk分别编码，
+ * grid_compressed_offset记下每个block在压缩文件里的起点（P*P+1个long，和grid_offset对应），grid_compressed_chunks记下每个chunk的起点（最后多一个文件大小）。
+ * 各线程并行编码一个block，按block的顺序写出。
+ */
+template <typename VertexId>
+void compress_grid(std::string output, int partitions, int edge_type, std::string grid) {
+	int parallelism = std::thread::hardware_concurrency();
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
 	double start_time = get_time();
-	while (true) {
-		long bytes = read(fin, buffers[cursor], IOSIZE);
-		assert(bytes!=-1);
-		if (bytes==0) break;
-		occupied[cursor] = true;
-		tasks.push(std::make_tuple(cursor, bytes));
-		read_bytes += bytes;
-		printf("progress: %.2f%%\r", 100. * read_bytes / total_bytes);
-		fflush(stdout);
-		while (occupied[cursor]) {
-			cursor = (cursor + 1) % (parallelism * 2);
-		}
+	long blocks = (long)partitions * partitions;
+	long * grid_offset = new long [blocks+1];
+	int fin_grid_offset = open((output+"/"+grid+"_offset").c_str(), O_RDONLY);
+	assert(pread_full(fin_grid_offset, (char *)grid_offset, sizeof(long)*(blocks+1), 0)==(long)sizeof(long)*(blocks+1));
+	close(fin_grid_offset);
+	int fin = open((output+"/"+grid).c_str(), O_RDONLY);
+	int fout = open((output+"/"+grid+"_compressed").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fin!=-1 && fout!=-1);
+
+	long * compressed_offset = new long [blocks+1];
+	std::vector<long> chunk_offset;
+	std::atomic<long> next_block(0);
+	long next_write = 0;
+	long write_offset = 0;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<std::thread> threads;
+	for (int ti=0;ti<parallelism;ti++) {
+		threads.emplace_back([&]() {
+			std::vector<char> buffer((long)COMPRESSEDCHUNK * edge_unit);
+			std::vector<char> encoded;
+			std::vector<long> chunk_bytes;
+			long k;
+			// 按文件里的顺序编号block，grid_offset[k]就是第k个block
+			while ((k = next_block.fetch_add(1)) < blocks) {
+				encoded.clear();
+				chunk_bytes.clear();
+				for (long offset=grid_offset[k];offset<grid_offset[k+1];) {
+					long bytes = std::min(grid_offset[k+1] - offset, (long)COMPRESSEDCHUNK * edge_unit);
+					assert(pread_full(fin, buffer.data(), bytes, offset)==bytes);
+					int edges = bytes / edge_unit;
+					size_t tail = encoded.size();
+					encoded.resize(tail + max_chunk_bytes<VertexId>(edges));
+					long length = encode_chunk<VertexId>(buffer.data(), edges, edge_unit, encoded.data() + tail);
+					encoded.resize(tail + length);
+					chunk_bytes.push_back(length);
+					offset += bytes;
+				}
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&]{ return next_write==k; });
+				compressed_offset[k] = write_offset;
+				for (long length : chunk_bytes) {
+					chunk_offset.push_back(write_offset);
+					write_offset += length;
+				}
+				pwrite_full(fout, encoded.data(), encoded.size(), compressed_offset[k]);
+				next_write++;
+				lock.unlock();
+				cond.notify_all();
+			}
+		});
+	}
+	for (int ti=0;ti<parallelism;ti++) {
+		threads[ti].join();
 	}
+	compressed_offset[blocks] = write_offset;
+	chunk_offset.push_back(write_offset);
 	close(fin);
-	assert(read_bytes==edges*edge_unit);
+	close(fout);
+	fout = open((output+"/"+grid+"_compressed_offset").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	pwrite_full(fout, (char *)compressed_offset, sizeof(long) * (blocks+1), 0);
+	close(fout);
+	fout = open((output+"/"+grid+"_compressed_chunks").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	pwrite_full(fout, (char *)chunk_offset.data(), sizeof(long) * chunk_offset.size(), 0);
+	close(fout);
+	printf("it takes %.2f seconds to compress %s: %ld -> %ld bytes (%.2fx)\n", get_time() - start_time, grid.c_str(),
+		grid_offset[blocks], write_offset, write_offset > 0 ? (double)grid_offset[blocks] / write_offset : 0.);
+	delete [] grid_offset;
+	delete [] compressed_offset;
+}
 
-	for (int ti=0;ti<parallelism;ti++) {
-		tasks.push(std::make_tuple(-1, 0));
+/**
+ * @brief 把带权的grid（row或column）拆成只有(source, target)的grid和按同样顺序存放weight的grid_property_0（第0个属性列），
+ * grid_offset换算成新的边大小，source summary按新的位置重新生成。各线程并行处理IOSIZE大小的一段。
+ */
+template <typename VertexId>
+void split_properties(std::string output, VertexId vertices, int partitions, std::string grid) {
+	int parallelism = std::thread::hardware_concurrency();
+	int edge_unit = sizeof(EdgeT<VertexId>);
+	int topology_unit = sizeof(VertexId) * 2;
+	double start_time = get_time();
+	long blocks = (long)partitions * partitions;
+	long * grid_offset = new long [blocks+1];
+	int fd_offset = open((output+"/"+grid+"_offset").c_str(), O_RDWR);
+	assert(fd_offset!=-1);
+	assert(pread_full(fd_offset, (char *)grid_offset, sizeof(long)*(blocks+1), 0)==(long)sizeof(long)*(blocks+1));
+	EdgeId edges = grid_offset[blocks] / edge_unit;
+	int fin = open((output+"/"+grid).c_str(), O_RDONLY);
+	int fout_topology = open((output+"/"+grid+"_topology").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	int fout_property = open((output+"/"+grid+"_property_0").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fin!=-1 && fout_topology!=-1 && fout_property!=-1);
+	assert(ftruncate(fout_topology, edges * topology_unit)==0);
+	assert(ftruncate(fout_property, edges * sizeof(Weight))==0);
+	long regions = (edges * topology_unit + SUMMARYSIZE - 1) / SUMMARYSIZE;
+	VertexId * summary = new VertexId [regions * 2];
+	for (long r=0;r<regions;r++) {
+		summary[r*2] = vertices;
+		summary[r*2+1] = -1;
 	}
 
+	EdgeId piece_edges = IOSIZE / edge_unit;
+	long pieces = (edges + piece_edges - 1) / piece_edges;
+	std::atomic<long> next_piece(0);
+	std::vector<std::thread> threads;
+	for (int ti=0;ti<parallelism;ti++) {
+		threads.emplace_back([&]() {
+			std::vector<char> buffer(piece_edges * edge_unit);
+			std::vector<VertexId> topology(piece_edges * 2);
+			std::vector<Weight> weights(piece_edges);
+			long k;
+			while ((k = next_piece.fetch_add(1)) < pieces) {
+				EdgeId begin_e = k * piece_edges;
+				EdgeId count = std::min(piece_edges, edges - begin_e);
+				assert(pread_full(fin, buffer.data(), count * edge_unit, begin_e * edge_unit)==count * edge_unit);
+				for (EdgeId e=0;e<count;e++) {
+					memcpy(&topology[e*2], buffer.data()+e*edge_unit, topology_unit);
+					memcpy(&weights[e], buffer.data()+e*edge_unit+topology_unit, sizeof(Weight));
+				}
+				pwrite_full(fout_topology, (char *)topology.data(), count * topology_unit, begin_e * topology_unit);
+				pwrite_full(fout_property, (char *)weights.data(), count * sizeof(Weight), begin_e * sizeof(Weight));
+				summarize_sources(summary, (char *)topology.data(), count * topology_unit, begin_e * topology_unit, topology_unit);
+			}
+		});
+	}
 	for (int ti=0;ti<parallelism;ti++) {
 		threads[ti].join();
 	}
+	close(fin);
+	close(fout_topology);
+	close(fout_property);
+	assert(rename((output+"/"+grid+"_topology").c_str(), (output+"/"+grid).c_str())==0);
+	for (long ij=0;ij<=blocks;ij++) {
+		grid_offset[ij] = grid_offset[ij] / edge_unit * topology_unit;
+	}
+	pwrite_full(fd_offset, (char *)grid_offset, sizeof(long)*(blocks+1), 0);
+	close(fd_offset);
+	write_summary(output+"/"+grid+"_summary", summary, regions);
+	delete [] summary;
+	delete [] grid_offset;
+	printf("it takes %.2f seconds to split edge properties out of %s\n", get_time() - start_time, grid.c_str());
+}
+
+// 按source partition逐个分段读row文件里的边，计数排序后写出CSR：csr_offset（vertices+1个EdgeId）、csr_neighbors以及带权图的csr_weights。
+// reverse时改为按target partition读column文件，写出入边的CSC：csc_offset、csc_neighbors（source）、csc_weights。
+// 一个partition的offset常驻内存，neighbors/weights按不超过memory_bytes的点区间分批排好写出，每批把partition的边从头读一遍
+template <typename VertexId>
+void generate_sparse_index(std::string output, VertexId vertices, int partitions, int edge_type, const PartitionMapT<VertexId> & partition_map, bool reverse, long memory_bytes) {
+	std::string prefix = reverse ? "/csc" : "/csr";
+	std::string grid = reverse ? "column" : "row";
+	// 排序用的key（source或target）和存下来的neighbor在边里的偏移
+	int key_pos = reverse ? sizeof(VertexId) : 0;
+	int neighbor_pos = reverse ? 0 : sizeof(VertexId);
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	// 一条边在内存里占一个neighbor和（带权时）一个weight
+	long entry_bytes = sizeof(VertexId) + ((edge_type==1) ? sizeof(Weight) : 0);
+	double start_time = get_time();
+	long * grid_offset = new long [partitions*partitions+1];
+	int fin_grid_offset = open((output+"/"+grid+"_offset").c_str(), O_RDONLY);
+	assert(pread_full(fin_grid_offset, (char *)grid_offset, sizeof(long)*(partitions*partitions+1), 0)==(long)sizeof(long)*(partitions*partitions+1));
+	close(fin_grid_offset);
 
-	printf("%lf -> ", get_time() - start_time);
-	long ts = 0;
+	int fin_grid = open((output+"/"+grid).c_str(), O_RDONLY);
+	int fout_offset = open((output+prefix+"_offset").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	int fout_neighbors = open((output+prefix+"_neighbors").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	int fout_weights = (edge_type==1) ? open((output+prefix+"_weights").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644) : -1;
+	assert(fin_grid!=-1 && fout_offset!=-1 && fout_neighbors!=-1);
+	char * buffer = (char *) memalign(PAGESIZE, IOSIZE);
+	long piece = IOSIZE / edge_unit * edge_unit;
+	EdgeId base = 0;
 	for (int i=0;i<partitions;i++) {
-		for (int j=0;j<partitions;j++) {
-			if (grid_buffer_offset[i][j]>0) {
-				ts += grid_buffer_offset[i][j];
-				write(fout[i][j], grid_buffer[i][j], grid_buffer_offset[i][j]);
+		VertexId begin_vid, end_vid;
+		std::tie(begin_vid, end_vid) = partition_map.range(i);
+		long partition_vertices = end_vid - begin_vid;
+		if ((partition_vertices + 1) * (long)sizeof(EdgeId) * 2 > memory_bytes) {
+			fprintf(stderr, "partition %d has %ld vertices, its sparse index offsets do not fit in the memory budget (-m); use more partitions (-p)\n", i, partition_vertices);
+			exit(-1);
+		}
+		// both grids keep partition i's blocks contiguous
+		long begin_offset = grid_offset[i*partitions];
+		long bytes = grid_offset[(i+1)*partitions] - begin_offset;
+		EdgeId * offset = new EdgeId [partition_vertices + 1]();
+		for (long pos=0;pos<bytes;pos+=piece) {
+			long length = std::min(piece, bytes - pos);
+			assert(pread_full(fin_grid, buffer, length, begin_offset + pos)==length);
+			for (long k=0;k<length;k+=edge_unit) {
+				offset[*(VertexId*)(buffer+k+key_pos) - begin_vid + 1]++;
 			}
 		}
+		for (long v=0;v<partition_vertices;v++) {
+			offset[v+1] += offset[v];
+		}
+		// [window_begin, window_end)里的点的边一起排：边数不超过memory_bytes能放下的，至少一个点
+		long window_edges = std::max(1l, (memory_bytes - (partition_vertices + 1) * (long)sizeof(EdgeId) * 2) / entry_bytes);
+		EdgeId * cursor = new EdgeId [partition_vertices];
+		for (long window_begin=0, window_end;window_begin<partition_vertices;window_begin=window_end) {
+			window_end = window_begin + 1;
+			while (window_end < partition_vertices && offset[window_end+1] - offset[window_begin] <= window_edges) window_end++;
+			EdgeId first = offset[window_begin];
+			EdgeId edges = offset[window_end] - first;
+			if (edges==0) continue;
+			VertexId * neighbors = new VertexId [edges];
+			Weight * weights = (edge_type==1) ? new Weight [edges] : NULL;
+			for (long v=window_begin;v<window_end;v++) {
+				cursor[v] = offset[v] - first;
+			}
+			for (long pos=0;pos<bytes;pos+=piece) {
+				long length = std::min(piece, bytes - pos);
+				assert(pread_full(fin_grid, buffer, length, begin_offset + pos)==length);
+				for (long k=0;k<length;k+=edge_unit) {
+					long v = *(VertexId*)(buffer+k+key_pos) - begin_vid;
+					if (v < window_begin || v >= window_end) continue;
+					EdgeId e = cursor[v]++;
+					neighbors[e] = *(VertexId*)(buffer+k+neighbor_pos);
+					if (edge_type==1) {
+						weights[e] = *(Weight*)(buffer+k+sizeof(VertexId)*2);
+					}
+				}
+			}
+			pwrite_full(fout_neighbors, (char *)neighbors, sizeof(VertexId) * edges, sizeof(VertexId) * (base + first));
+			if (edge_type==1) {
+				pwrite_full(fout_weights, (char *)weights, sizeof(Weight) * edges, sizeof(Weight) * (base + first));
+				delete [] weights;
+			}
+			delete [] neighbors;
+		}
+		EdgeId edges = offset[partition_vertices];
+		for (long v=0;v<partition_vertices;v++) {
+			offset[v] += base;
+		}
+		pwrite_full(fout_offset, (char *)offset, sizeof(EdgeId) * partition_vertices, sizeof(EdgeId) * (long)begin_vid);
+		base += edges;
+		delete [] cursor;
+		delete [] offset;
 	}
-	printf("%lf (%ld)\n", get_time() - start_time, ts);
+	pwrite_full(fout_offset, (char *)&base, sizeof(EdgeId), sizeof(EdgeId) * (long)vertices);
+	close(fout_offset);
+	close(fout_neighbors);
+	if (fout_weights!=-1) close(fout_weights);
+	close(fin_grid);
+	free(buffer);
+	delete [] grid_offset;
+	printf("it takes %.2f seconds to generate %s index\n", get_time() - start_time, reverse ? "in-edge" : "out-edge");
+}
 
-	for (int i=0;i<partitions;i++) {
-		for (int j=0;j<partitions;j++) {
-			close(fout[i][j]);
+/**
+ * @brief 逐个source partition读row，统计每个block的边数、source/target范围、不同source的个数和source出度的粗略直方图，
+ * 写到block_stats（P*P个BlockStats，按row的(i, j)顺序）。顺便累计每个点的出度和入度，写到out_degree和in_degree（各|V|个VertexId，可直接用BigVector打开）。
+ */
+template <typename VertexId>
+void generate_block_stats(std::string output, VertexId vertices, int partitions, int edge_type, const PartitionMapT<VertexId> & partition_map) {
+	int parallelism = std::thread::hardware_concurrency();
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	double start_time = get_time();
+	long * row_offset = new long [partitions*partitions+1];
+	int fin_row_offset = open((output+"/row_offset").c_str(), O_RDONLY);
+	assert(pread_full(fin_row_offset, (char *)row_offset, sizeof(long)*(partitions*partitions+1), 0)==(long)sizeof(long)*(partitions*partitions+1));
+	close(fin_row_offset);
+	int fin_row = open((output+"/row").c_str(), O_RDONLY);
+	assert(fin_row!=-1);
+	BlockStatsT<VertexId> * stats = new BlockStatsT<VertexId> [(long)partitions*partitions];
+	// 一个source partition只由一个线程处理，出度不需要原子操作
+	VertexId * out_degree = new VertexId [vertices]();
+	VertexId * in_degree = new VertexId [vertices]();
+	std::atomic<int> next_partition(0);
+	std::vector<std::thread> threads;
+	for (int ti=0;ti<parallelism;ti++) {
+		threads.emplace_back([&]() {
+			char * buffer = (char *)memalign(PAGESIZE, IOSIZE);
+			std::vector<VertexId> degree;
+			std::vector<VertexId> sources;
+			int i;
+			while ((i = next_partition.fetch_add(1)) < partitions) {
+				VertexId begin_vid, end_vid;
+				std::tie(begin_vid, end_vid) = partition_map.range(i);
+				degree.assign(end_vid - begin_vid, 0);
+				for (int j=0;j<partitions;j++) {
+					BlockStatsT<VertexId> & block = stats[(long)i*partitions+j];
+					memset(&block, 0, sizeof(BlockStatsT<VertexId>));
+					block.min_source = block.min_target = vertices;
+					block.max_source = block.max_target = -1;
+					sources.clear();
+					for (long offset=row_offset[i*partitions+j];offset<row_offset[i*partitions+j+1];) {
+						long bytes = std::min(row_offset[i*partitions+j+1] - offset, (long)IOSIZE / edge_unit * edge_unit);
+						assert(pread_full(fin_row, buffer, bytes, offset)==bytes);
+						for (long pos=0;pos<bytes;pos+=edge_unit) {
+							VertexId source = *(VertexId*)(buffer+pos);
+							VertexId target = *(VertexId*)(buffer+pos+sizeof(VertexId));
+							if (source < block.min_source) block.min_source = source;
+							if (source > block.max_source) block.max_source = source;
+							if (target < block.min_target) block.min_target = target;
+							if (target > block.max_target) block.max_target = target;
+							if (degree[source - begin_vid]++==0) sources.push_back(source);
+							__sync_fetch_and_add(&in_degree[target], 1);
+						}
+						offset += bytes;
+					}
+					block.edges = (row_offset[i*partitions+j+1] - row_offset[i*partitions+j]) / edge_unit;
+					block.distinct_sources = sources.size();
+					for (VertexId source : sources) {
+						int k = 0;
+						while (k < DEGREEBUCKETS - 1 && (degree[source - begin_vid] >> (k + 1)) > 0) k++;
+						block.degree_histogram[k]++;
+						out_degree[source] += degree[source - begin_vid];
+						degree[source - begin_vid] = 0;
+					}
+				}
+			}
+			free(buffer);
+		});
+	}
+	for (int ti=0;ti<parallelism;ti++) {
+		threads[ti].join();
+	}
+	close(fin_row);
+	int fout = open((output+"/block_stats").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	pwrite_full(fout, (char *)stats, sizeof(BlockStatsT<VertexId>) * partitions * partitions, 0);
+	close(fout);
+	fout = open((output+"/out_degree").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	pwrite_full(fout, (char *)out_degree, sizeof(VertexId) * vertices, 0);
+	close(fout);
+	fout = open((output+"/in_degree").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	pwrite_full(fout, (char *)in_degree, sizeof(VertexId) * vertices, 0);
+	close(fout);
+	delete [] stats;
+	delete [] out_degree;
+	delete [] in_degree;
+	delete [] row_offset;
+	printf("it takes %.2f seconds to generate block statistics and degrees\n", get_time() - start_time);
+}
+
+// 重新编号的方式
+#define ORDER_NONE 0
+#define ORDER_DEGREE 1
+#define ORDER_BFS 2
+#define ORDER_RCM 3
+#define ORDER_GORDER 4
+// Gorder的窗口大小
+#define GORDER_WINDOW 5
+
+int parse_order(std::string name) {
+	if (name=="degree") return ORDER_DEGREE;
+	if (name=="bfs") return ORDER_BFS;
+	if (name=="rcm") return ORDER_RCM;
+	if (name=="gorder") return ORDER_GORDER;
+	fprintf(stderr, "unknown ordering (%s), use degree, bfs, rcm or gorder\n", name.c_str());
+	exit(-1);
+}
+
+/**
+ * @brief 按邻居关系给点重新编号，让一个block里访问的点数据尽量集中。返回order，order[新id] = 原始id。
+ * degree：按度数（出度+入度）从大到小；bfs：从度数最大的点开始BFS；
+ * rcm：Reverse Cuthill-McKee，每个连通分量从度数最小的点开始，邻居按度数从小到大入队，最后整体反转；
+ * gorder：简化的Gorder，贪心地选和最近GORDER_WINDOW个点共享邻居/直接相连最多的点，度数超过sqrt(|V|)的hub不参与共享邻居的计数。
+ * 除degree外都把图当无向图处理，需要在内存里建一份2|E|的邻接表。
+ */
+template <typename VertexId>
+VertexId * compute_order(const char * edge_data, EdgeId edges, int edge_unit, VertexId vertices, int order) {
+	EdgeId * degree = new EdgeId [vertices]();
+	for (EdgeId e=0;e<edges;e++) {
+		VertexId source = *(VertexId*)(edge_data+e*edge_unit);
+		VertexId target = *(VertexId*)(edge_data+e*edge_unit+sizeof(VertexId));
+		if (source<0 || source>=vertices || target<0 || target>=vertices) {
+			printf("edge (%ld, %ld) exceeds the vertex range [0, %ld)!\n", (long)source, (long)target, (long)vertices);
+			exit(-1);
 		}
+		degree[source]++;
+		degree[target]++;
+	}
+	VertexId * by_degree = new VertexId [vertices];
+	for (VertexId v=0;v<vertices;v++) {
+		by_degree[v] = v;
+	}
+	std::stable_sort(by_degree, by_degree+vertices, [&](VertexId a, VertexId b) {
+		return degree[a] > degree[b];
+	});
+	if (order==ORDER_DEGREE) {
+		delete [] degree;
+		return by_degree;
 	}
 
-	printf("it takes %.2f seconds to generate edge blocks\n", get_time() - start_time);
+	EdgeId * offset = new EdgeId [vertices+1];
+	offset[0] = 0;
+	for (VertexId v=0;v<vertices;v++) {
+		offset[v+1] = offset[v] + degree[v];
+	}
+	EdgeId * cursor = new EdgeId [vertices];
+	memcpy(cursor, offset, sizeof(EdgeId) * vertices);
+	VertexId * neighbors = new VertexId [offset[vertices]];
+	for (EdgeId e=0;e<edges;e++) {
+		VertexId source = *(VertexId*)(edge_data+e*edge_unit);
+		VertexId target = *(VertexId*)(edge_data+e*edge_unit+sizeof(VertexId));
+		neighbors[cursor[source]++] = target;
+		neighbors[cursor[target]++] = source;
+	}
+	delete [] cursor;
 
-	long offset;
-	int fout_column = open((output+"/column").c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
-	int fout_column_offset = open((output+"/column_offset").c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
-	offset = 0;
-	for (int j=0;j<partitions;j++) {
-		for (int i=0;i<partitions;i++) {
-			printf("progress: %.2f%%\r", 100. * offset / total_bytes);
-			fflush(stdout);
-			write(fout_column_offset, &offset, sizeof(offset));
-			char filename[4096];
-			sprintf(filename, "%s/block-%d-%d", output.c_str(), i, j);
-			offset += file_size(filename);
-			fin = open(filename, O_RDONLY);
-			while (true) {
-				long bytes = read(fin, buffers[0], IOSIZE);
-				assert(bytes!=-1);
-				if (bytes==0) break;
-				write(fout_column, buffers[0], bytes);
+	VertexId * new_order = new VertexId [vertices];
+	bool * placed = new bool [vertices]();
+	VertexId placed_vertices = 0;
+	if (order==ORDER_BFS || order==ORDER_RCM) {
+		if (order==ORDER_RCM) {
+			// 度数小的邻居先入队
+			for (VertexId v=0;v<vertices;v++) {
+				std::sort(neighbors+offset[v], neighbors+offset[v+1], [&](VertexId a, VertexId b) {
+					return degree[a] < degree[b];
+				});
 			}
-			close(fin);
 		}
-	}
-	write(fout_column_offset, &offset, sizeof(offset));
-	close(fout_column_offset);
-	close(fout_column);
-	printf("column oriented grid generated\n");
-	int fout_row = open((output+"/row").c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
-	int fout_row_offset = open((output+"/row_offset").c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
-	offset = 0;
-	for (int i=0;i<partitions;i++) {
-		for (int j=0;j<partitions;j++) {
-			printf("progress: %.2f%%\r", 100. * offset / total_bytes);
-			fflush(stdout);
-			write(fout_row_offset, &offset, sizeof(offset));
-			char filename[4096];
-			sprintf(filename, "%s/block-%d-%d", output.c_str(), i, j);
-			offset += file_size(filename);
-			fin = open(filename, O_RDONLY);
-			while (true) {
-				long bytes = read(fin, buffers[0], IOSIZE);
-				assert(bytes!=-1);
-				if (bytes==0) break;
-				write(fout_row, buffers[0], bytes);
+		for (VertexId k=0;k<vertices;k++) {
+			// bfs从度数最大的点开始，rcm从度数最小的点开始
+			VertexId root = (order==ORDER_BFS) ? by_degree[k] : by_degree[vertices-1-k];
+			if (placed[root]) continue;
+			VertexId head = placed_vertices;
+			new_order[placed_vertices++] = root;
+			placed[root] = true;
+			while (head < placed_vertices) {
+				VertexId v = new_order[head++];
+				for (EdgeId i=offset[v];i<offset[v+1];i++) {
+					VertexId u = neighbors[i];
+					if (!placed[u]) {
+						placed[u] = true;
+						new_order[placed_vertices++] = u;
+					}
+				}
 			}
-			close(fin);
 		}
+		if (order==ORDER_RCM) {
+			std::reverse(new_order, new_order+vertices);
+		}
+	} else {
+		EdgeId hub_degree = (EdgeId)sqrt((double)vertices);
+		// 按score分桶的双向链表，score只会加减1，增减和取最大都是O(1)（均摊）
+		int * score = new int [vertices]();
+		VertexId * prev = new VertexId [vertices];
+		VertexId * next = new VertexId [vertices];
+		std::vector<VertexId> head(1, -1);
+		int max_score = 0;
+		auto unlink_vertex = [&](VertexId v) {
+			if (prev[v]!=-1) next[prev[v]] = next[v]; else head[score[v]] = next[v];
+			if (next[v]!=-1) prev[next[v]] = prev[v];
+		};
+		auto link_vertex = [&](VertexId v) {
+			if (score[v]>=(int)head.size()) head.resize(score[v]+1, -1);
+			prev[v] = -1;
+			next[v] = head[score[v]];
+			if (next[v]!=-1) prev[next[v]] = v;
+			head[score[v]] = v;
+			if (score[v] > max_score) max_score = score[v];
+		};
+		// score相同的时候先取度数大的点
+		for (VertexId k=vertices-1;k>=0;k--) {
+			link_vertex(by_degree[k]);
+		}
+		auto adjust = [&](VertexId u, int delta) {
+			unlink_vertex(u);
+			score[u] += delta;
+			link_vertex(u);
+		};
+		auto update = [&](VertexId v, int delta) {
+			for (EdgeId i=offset[v];i<offset[v+1];i++) {
+				VertexId u = neighbors[i];
+				if (!placed[u]) adjust(u, delta);
+				if (degree[u] > hub_degree) continue;
+				for (EdgeId j=offset[u];j<offset[u+1];j++) {
+					VertexId w = neighbors[j];
+					if (w!=v && !placed[w]) adjust(w, delta);
+				}
+			}
+		};
+		while (placed_vertices < vertices) {
+			while (head[max_score]==-1) max_score--;
+			VertexId v = head[max_score];
+			unlink_vertex(v);
+			placed[v] = true;
+			new_order[placed_vertices++] = v;
+			update(v, 1);
+			if (placed_vertices > GORDER_WINDOW) {
+				update(new_order[placed_vertices-1-GORDER_WINDOW], -1);
+			}
+		}
+		delete [] score;
+		delete [] prev;
+		delete [] next;
 	}
-	write(fout_row_offset, &offset, sizeof(offset));
-	close(fout_row_offset);
-	close(fout_row);
-	printf("row oriented grid generated\n");
+	delete [] placed;
+	delete [] neighbors;
+	delete [] offset;
+	delete [] degree;
+	delete [] by_degree;
+	return new_order;
+}
 
-	printf("it takes %.2f seconds to generate edge grid\n", get_time() - start_time);
+/**
+ * @brief 重新编号：写出permutation（permutation[原始id] = 新id），并把换成新id的边写到output/relabeled，返回这个文件的路径。
+ */
+template <typename VertexId>
+std::string relabel(std::string input, std::string output, VertexId vertices, int edge_type, int order) {
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	double start_time = get_time();
+	long bytes = file_size(input);
+	EdgeId edges = bytes / edge_unit;
+	int fin = open(input.c_str(), O_RDONLY);
+	assert(fin!=-1);
+	char * edge_data = (char *)mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fin, 0);
+	assert(edge_data!=MAP_FAILED);
+	madvise(edge_data, bytes, MADV_SEQUENTIAL);
 
-	FILE * fmeta = fopen((output+"/meta").c_str(), "w");
-	fprintf(fmeta, "%d %d %ld %d", edge_type, vertices, edges, partitions);
-	fclose(fmeta);
+	VertexId * new_order = compute_order(edge_data, edges, edge_unit, vertices, order);
+	VertexId * permutation = new VertexId [vertices];
+	for (VertexId v=0;v<vertices;v++) {
+		permutation[new_order[v]] = v;
+	}
+	delete [] new_order;
+	int fout = open((output+"/permutation").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	pwrite_full(fout, (char *)permutation, sizeof(VertexId) * vertices, 0);
+	close(fout);
+
+	std::string relabeled = output + "/relabeled";
+	fout = open(relabeled.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	char * buffer = (char *)memalign(PAGESIZE, IOSIZE);
+	for (long offset=0;offset<bytes;) {
+		long length = std::min(bytes - offset, (long)IOSIZE / edge_unit * edge_unit);
+		memcpy(buffer, edge_data+offset, length);
+		for (long pos=0;pos<length;pos+=edge_unit) {
+			VertexId * edge = (VertexId *)(buffer+pos);
+			edge[0] = permutation[edge[0]];
+			edge[1] = permutation[edge[1]];
+		}
+		assert(write(fout, buffer, length)==length);
+		offset += length;
+	}
+	close(fout);
+	free(buffer);
+	delete [] permutation;
+	munmap(edge_data, bytes);
+	close(fin);
+	printf("it takes %.2f seconds to relabel vertices\n", get_time() - start_time);
+	return relabeled;
 }
 
-int main(int argc, char ** argv) {
-	int opt;
+/**
+ * @brief 按边数和点数的混合代价切分partition：点v的代价是它的出度+入度再加上平均度数，
+ * 这样每个partition的边数（行和列）大致相等，同时点数也不会差得太多。边界写到output/partition_offset。
+ */
+template <typename VertexId>
+std::vector<VertexId> balance_partitions(std::string input, std::string output, VertexId vertices, int partitions, int edge_type) {
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	double start_time = get_time();
+	long bytes = file_size(input);
+	EdgeId edges = bytes / edge_unit;
+	int fin = open(input.c_str(), O_RDONLY);
+	assert(fin!=-1);
+	char * edge_data = (char *)mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fin, 0);
+	assert(edge_data!=MAP_FAILED);
+	madvise(edge_data, bytes, MADV_SEQUENTIAL);
+	EdgeId * cost = new EdgeId [vertices]();
+	for (EdgeId e=0;e<edges;e++) {
+		VertexId source = *(VertexId*)(edge_data+e*edge_unit);
+		VertexId target = *(VertexId*)(edge_data+e*edge_unit+sizeof(VertexId));
+		if (source<0 || source>=vertices || target<0 || target>=vertices) {
+			printf("edge (%ld, %ld) exceeds the vertex range [0, %ld)!\n", (long)source, (long)target, (long)vertices);
+			exit(-1);
+		}
+		cost[source]++;
+		cost[target]++;
+	}
+	munmap(edge_data, bytes);
+	close(fin);
+	EdgeId average_degree = (edges * 2 + vertices - 1) / vertices;
+	EdgeId total_cost = edges * 2 + average_degree * vertices;
+	std::vector<VertexId> offset(partitions + 1);
+	offset[0] = 0;
+	EdgeId prefix = 0;
+	VertexId v = 0;
+	for (int i=1;i<partitions;i++) {
+		// 每个partition至少一个点
+		while (v < vertices - (partitions - i) && (v < offset[i-1] + 1 || prefix * partitions < total_cost * i)) {
+			prefix += cost[v] + average_degree;
+			v++;
+		}
+		offset[i] = v;
+	}
+	offset[partitions] = vertices;
+	delete [] cost;
+	int fout = open((output+"/partition_offset").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+	assert(write(fout, offset.data(), sizeof(VertexId) * (partitions + 1))==(long)sizeof(VertexId) * (partitions + 1));
+	close(fout);
+	printf("it takes %.2f seconds to balance partitions\n", get_time() - start_time);
+	return offset;
+}
+
+// 文本边表按TEXTCHUNK字节切块并行解析
+#define TEXTCHUNK (1048576 * 4)
+
+// 跳过空格、制表符和逗号，不跨行
+inline const char * skip_separators(const char * p, const char * end) {
+	while (p < end && (*p==' ' || *p=='\t' || *p==',' || *p=='\r')) p++;
+	return p;
+}
+
+// 解析一个不超过max_value的非负整数，没有数字或超出范围时返回nullptr
+inline const char * parse_id(const char * p, const char * end, long & value, long max_value) {
+	if (p==end || *p<'0' || *p>'9') return nullptr;
+	value = 0;
+	while (p < end && *p>='0' && *p<='9') {
+		if (value > (max_value - (*p - '0')) / 10) return nullptr;
+		value = value * 10 + (*p - '0');
+		p++;
+	}
+	return p;
+}
+
+// 解析[-]digits[.digits][e[-]digits]形式的浮点数，没有数字时返回nullptr
+inline const char * parse_weight(const char * p, const char * end, Weight & value) {
+	bool negative = false;
+	if (p < end && (*p=='-' || *p=='+')) {
+		negative = (*p=='-');
+		p++;
+	}
+	double mantissa = 0;
+	int digits = 0;
+	while (p < end && *p>='0' && *p<='9') {
+		mantissa = mantissa * 10 + (*p - '0');
+		digits++;
+		p++;
+	}
+	if (p < end && *p=='.') {
+		p++;
+		double scale = 0.1;
+		while (p < end && *p>='0' && *p<='9') {
+			mantissa += (*p - '0') * scale;
+			scale *= 0.1;
+			digits++;
+			p++;
+		}
+	}
+	if (digits==0) return nullptr;
+	if (p < end && (*p=='e' || *p=='E')) {
+		p++;
+		bool negative_exponent = false;
+		if (p < end && (*p=='-' || *p=='+')) {
+			negative_exponent = (*p=='-');
+			p++;
+		}
+		int exponent = 0;
+		while (p < end && *p>='0' && *p<='9') {
+			exponent = exponent * 10 + (*p - '0');
+			p++;
+		}
+		mantissa *= pow(10.0, negative_exponent ? -exponent : exponent);
+	}
+	value = negative ? -mantissa : mantissa;
+	return p;
+}
+
+/**
+ * @brief 把文本边表（每行"source target"或"source target weight"，空格/制表符/逗号分隔，#或%开头的行是注释）
+ * 并行解析成二进制边表output/edgelist，返回这个文件的路径。max_id返回出现过的最大点id。
+ * 输入按TEXTCHUNK切块，块边界挪到下一个换行之后；各线程解析完自己的块后按块的顺序写出，输出的边序和输入一致。
+ */
+template <typename VertexId>
+std::string parse_text(std::string input, std::string output, int edge_type, VertexId & max_id) {
+	int parallelism = std::thread::hardware_concurrency();
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	double start_time = get_time();
+	long bytes = file_size(input);
+	int fin = open(input.c_str(), O_RDONLY);
+	assert(fin!=-1);
+	const char * text = nullptr;
+	if (bytes > 0) {
+		text = (const char *)mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fin, 0);
+		assert(text!=MAP_FAILED);
+		madvise((void *)text, bytes, MADV_SEQUENTIAL);
+	}
+	std::string edge_list = output + "/edgelist";
+	int fout = open(edge_list.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	assert(fout!=-1);
+
+	// 第k块从k*TEXTCHUNK-1之后的第一个换行的下一个字节开始
+	auto chunk_begin = [&](long k) {
+		if (k==0) return 0l;
+		long pos = k * TEXTCHUNK - 1;
+		if (pos >= bytes) return bytes;
+		const char * newline = (const char *)memchr(text + pos, '\n', bytes - pos);
+		return (newline==nullptr) ? bytes : (long)(newline - text) + 1;
+	};
+	long chunks = (bytes + TEXTCHUNK - 1) / TEXTCHUNK;
+	std::atomic<long> next_chunk(0);
+	long next_write = 0;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic<EdgeId> edges(0);
+	std::vector<VertexId> local_max_id(parallelism, -1);
+	std::vector<std::thread> threads;
+	for (int ti=0;ti<parallelism;ti++) {
+		threads.emplace_back([&, ti]() {
+			std::vector<char> parsed;
+			VertexId max_id = -1;
+			long k;
+			while ((k = next_chunk.fetch_add(1)) < chunks) {
+				const char * p = text + chunk_begin(k);
+				const char * end = text + chunk_begin(k + 1);
+				parsed.clear();
+				while (p < end) {
+					const char * line_end = (const char *)memchr(p, '\n', end - p);
+					if (line_end==nullptr) line_end = end;
+					const char * q = skip_separators(p, line_end);
+					if (q < line_end && *q!='#' && *q!='%') {
+						long source, target;
+						Weight weight = 1;
+						q = parse_id(q, line_end, source, std::numeric_limits<VertexId>::max());
+						if (q!=nullptr) q = parse_id(skip_separators(q, line_end), line_end, target, std::numeric_limits<VertexId>::max());
+						if (q!=nullptr && edge_type==1) q = parse_weight(skip_separators(q, line_end), line_end, weight);
+						if (q==nullptr) {
+							fprintf(stderr, "cannot parse line (ids wider than %d bytes need -w 8): %.*s\n", (int)sizeof(VertexId), (int)(line_end - p), p);
+							exit(-1);
+						}
+						size_t tail = parsed.size();
+						parsed.resize(tail + edge_unit);
+						VertexId * edge = (VertexId *)(parsed.data() + tail);
+						edge[0] = source;
+						edge[1] = target;
+						if (edge_type==1) memcpy(edge + 2, &weight, sizeof(Weight));
+						if (source > max_id) max_id = source;
+						if (target > max_id) max_id = target;
+					}
+					p = line_end + 1;
+				}
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&]{ return next_write==k; });
+				assert(write(fout, parsed.data(), parsed.size())==(long)parsed.size());
+				edges += parsed.size() / edge_unit;
+				next_write++;
+				lock.unlock();
+				cond.notify_all();
+			}
+			local_max_id[ti] = max_id;
+		});
+	}
+	for (int ti=0;ti<parallelism;ti++) {
+		threads[ti].join();
+	}
+	close(fout);
+	if (bytes > 0) munmap((void *)text, bytes);
+	close(fin);
+	max_id = *std::max_element(local_max_id.begin(), local_max_id.end());
+	printf("it takes %.2f seconds to parse %ld edges from text\n", get_time() - start_time, edges.load());
+	return edge_list;
+}
+
+// 没有给出-v时扫一遍二进制边表取最大的点id
+template <typename VertexId>
+VertexId scan_max_id(std::string input, int edge_type) {
+	int parallelism = std::thread::hardware_concurrency();
+	int edge_unit = (edge_type==0) ? sizeof(VertexId) * 2 : sizeof(EdgeT<VertexId>);
+	long bytes = file_size(input);
+	EdgeId edges = bytes / edge_unit;
+	if (edges==0) return -1;
+	int fin = open(input.c_str(), O_RDONLY);
+	assert(fin!=-1);
+	char * edge_data = (char *)mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fin, 0);
+	assert(edge_data!=MAP_FAILED);
+	madvise(edge_data, bytes, MADV_SEQUENTIAL);
+	std::vector<VertexId> local_max_id(parallelism, -1);
+	std::vector<std::thread> threads;
+	for (int ti=0;ti<parallelism;ti++) {
+		threads.emplace_back([&, ti]() {
+			VertexId max_id = -1;
+			for (EdgeId e=edges*ti/parallelism;e<edges*(ti+1)/parallelism;e++) {
+				VertexId source = *(VertexId*)(edge_data+e*edge_unit);
+				VertexId target = *(VertexId*)(edge_data+e*edge_unit+sizeof(VertexId));
+				if (source > max_id) max_id = source;
+				if (target > max_id) max_id = target;
+			}
+			local_max_id[ti] = max_id;
+		});
+	}
+	for (int ti=0;ti<parallelism;ti++) {
+		threads[ti].join();
+	}
+	munmap(edge_data, bytes);
+	close(fin);
+	return *std::max_element(local_max_id.begin(), local_max_id.end());
+}
+
+/**
+ * @brief 从命令行解析出来的参数，vertices为-1时由边表里最大的点id决定
+ */
+struct Options {
 	std::string input = "";
 	std::string output = "";
-	VertexId vertices = -1;
+	long vertices = -1;
 	int partitions = -1;
 	int edge_type = 0;
-	while ((opt = getopt(argc, argv, "i:o:v:p:t:")) != -1) {
+	bool sparse_index = false;
+	int order = ORDER_NONE;
+	bool balanced = false;
+	bool text = false;
+	int block_order = BLOCKORDER_NONE;
+	bool compressed = false;
+	bool split = false;
+	long memory_bytes = 8l*1024l*1024l*1024l;
+};
+
+// 按options生成grid，VertexId是输入边表和grid里点id的类型
+template <typename VertexId>
+void preprocess(Options options) {
+	std::string input = options.input;
+	std::string output = options.output;
+	VertexId vertices = options.vertices;
+	int partitions = options.partitions;
+	int edge_type = options.edge_type;
+	bool text = options.text;
+	int order = options.order;
+	int block_order = options.block_order;
+	bool compressed = options.compressed;
+	bool split = options.split;
+	if (file_exists(output)) {
+		remove_directory(output);
+	}
+	create_directory(output);
+	std::string edge_list = input;
+	VertexId max_id = -1;
+	if (text) {
+		edge_list = parse_text(input, output, edge_type, max_id);
+	} else if (vertices==-1) {
+		max_id = scan_max_id<VertexId>(input, edge_type);
+	}
+	if (vertices==-1) {
+		vertices = max_id + 1;
+		printf("detected %ld vertices\n", (long)vertices);
+	}
+	if (vertices<=0) {
+		fprintf(stderr, "the edge list is empty\n");
+		exit(-1);
+	}
+	if (partitions==-1) {
+		partitions = std::max(1l, (long)vertices / CHUNKSIZE);
+	}
+	std::string parsed = edge_list;
+	if (order!=ORDER_NONE) {
+		edge_list = relabel(edge_list, output, vertices, edge_type, order);
+	}
+	// 相邻的边target接近时差值编码才短
+	if (compressed && block_order==BLOCKORDER_NONE) {
+		block_order = BLOCKORDER_TARGET;
+	}
+	PartitionMapT<VertexId> partition_map;
+	if (options.balanced) {
+		std::vector<VertexId> offset = balance_partitions(edge_list, output, vertices, partitions, edge_type);
+		partition_map.init(vertices, partitions, offset.data());
+	} else {
+		partition_map.init(vertices, partitions);
+	}
+	generate_edge_grid(edge_list, output, vertices, partitions, edge_type, partition_map);
+	if (block_order!=BLOCKORDER_NONE) {
+		sort_blocks(output, vertices, partitions, edge_type, partition_map, block_order, options.memory_bytes);
+	}
+	generate_block_stats(output, vertices, partitions, edge_type, partition_map);
+	if (order!=ORDER_NONE) {
+		unlink(edge_list.c_str());
+	}
+	if (text) {
+		unlink(parsed.c_str());
+	}
+	if (options.sparse_index) {
+		generate_sparse_index(output, vertices, partitions, edge_type, partition_map, false, options.memory_bytes);
+		generate_sparse_index(output, vertices, partitions, edge_type, partition_map, true, options.memory_bytes);
+	}
+	if (split) {
+		split_properties(output, vertices, partitions, "row");
+		split_properties(output, vertices, partitions, "column");
+	}
+	if (compressed) {
+		compress_grid<VertexId>(output, partitions, edge_type, "row");
+		compress_grid<VertexId>(output, partitions, edge_type, "column");
+		// 保留row_offset/column_offset（block的原始大小），原始的边和只对原始格式有效的summary删掉
+		unlink((output+"/row").c_str());
+		unlink((output+"/column").c_str());
+		unlink((output+"/row_summary").c_str());
+		unlink((output+"/column_summary").c_str());
+	}
+}
+
+int main(int argc, char ** argv) {
+	int opt;
+	Options options;
+	int id_bytes = 4;
+	while ((opt = getopt(argc, argv, "i:o:v:p:t:sr:ef:b:cxw:m:")) != -1) {
 		switch (opt) {
 		case 'i':
-			input = optarg;
+			options.input = optarg;
 			break;
 		case 'o':
-			output = optarg;
+			options.output = optarg;
 			break;
 		case 'v':
-			vertices = atoi(optarg);
+			options.vertices = atol(optarg);
 			break;
 		case 'p':
-			partitions = atoi(optarg);
+			options.partitions = atoi(optarg);
 			break;
 		case 't':
-			edge_type = atoi(optarg);
+			options.edge_type = atoi(optarg);
+			break;
+		case 's':
+			options.sparse_index = true;
+			break;
+		case 'r':
+			options.order = parse_order(optarg);
+			break;
+		case 'e':
+			options.balanced = true;
+			break;
+		case 'f':
+			if (strcmp(optarg, "text")==0) {
+				options.text = true;
+			} else if (strcmp(optarg, "binary")!=0) {
+				fprintf(stderr, "unknown input format (%s), use binary or text\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'b':
+			options.block_order = parse_block_order(optarg);
+			break;
+		case 'c':
+			options.compressed = true;
+			break;
+		case 'x':
+			options.split = true;
+			break;
+		case 'w':
+			id_bytes = atoi(optarg);
+			break;
+		case 'm':
+			options.memory_bytes = atol(optarg)*1024l*1024l*1024l;
 			break;
 		}
 	}
-	if (input=="" || output=="" || vertices==-1) {
-		fprintf(stderr, "usage: %s -i [input path] -o [output path] -v [vertices] -p [partitions] -t [edge type: 0=unweighted, 1=weighted]\n", argv[0]);
+	if (options.input=="" || options.output=="") {
+		fprintf(stderr, "usage: %s -i [input path] -o [output path] [-v vertices: max vertex id + 1 if omitted] -p [partitions] -t [edge type: 0=unweighted, 1=weighted] [-f format: binary (default) or text] [-s: also build the sparse (CSR/CSC) indexes] [-r ordering: relabel vertices by degree, bfs, rcm or gorder] [-e: balance edges across partitions] [-b block ordering: sort edges inside each block by target, source or hilbert] [-c: compress the grid (implies -b target unless -b is given)] [-x: store weights apart from (source, target)] [-w vertex id bytes: 4 (default) or 8] [-m memory budget in GB for sorting blocks and building the sparse indexes: 8 if omitted]\n", argv[0]);
 		exit(-1);
 	}
-	if (partitions==-1) {
-		partitions = vertices / CHUNKSIZE;
+	if (options.split && options.edge_type!=1) {
+		fprintf(stderr, "-x needs a weighted graph (-t 1)\n");
+		exit(-1);
+	}
+	if (options.split && options.compressed) {
+		fprintf(stderr, "-x and -c cannot be combined\n");
+		exit(-1);
+	}
+	if (id_bytes!=4 && id_bytes!=8) {
+		fprintf(stderr, "vertex ids are 4 or 8 bytes (got %d)\n", id_bytes);
+		exit(-1);
+	}
+	if (id_bytes==4 && options.vertices > std::numeric_limits<VertexId>::max()) {
+		fprintf(stderr, "%ld vertices need 8-byte vertex ids (-w 8)\n", options.vertices);
+		exit(-1);
+	}
+	if (id_bytes==8) {
+		preprocess<long>(options);
+	} else {
+		preprocess<VertexId>(options);
 	}
-	generate_edge_grid(input, output, vertices, partitions, edge_type);
 	return 0;
 }
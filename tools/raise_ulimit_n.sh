@@ -1 +0,0 @@
-sudo sh -c "ulimit -n 1048576 && exec su $LOGNAME"